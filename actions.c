@@ -252,8 +252,9 @@ action_is_remove(action_t action)
 }
 
 /*
- * Execute "pkg_admin rebuild-tree" to rebuild +REQUIRED_BY files after any
- * operation that changes the installed packages.
+ * Execute "pkg_admin rebuild-tree" to rebuild every +REQUIRED_BY file, used
+ * to verify the ones written by update_required_by().  The caller opens the
+ * pkg_install log.
  */
 static int
 rebuild_required_by(void)
@@ -268,15 +269,203 @@ rebuild_required_by(void)
 	 */
 	cmd = xasprintf("%s rebuild-tree >/dev/null", pkg_admin);
 
-	open_pi_log();
 	rv = system(cmd);
-	close_pi_log(0);
 
 	free(cmd);
 
 	return rv;
 }
 
+/*
+ * Save LOCAL_REQUIRED_BY before changing the installed packages, so that
+ * update_required_by() can tell which +REQUIRED_BY files need writing.
+ */
+static void
+save_required_by(void)
+{
+	if (pkgindb_doquery(SAVE_REQUIRED_BY, NULL, NULL) != PDB_OK)
+		errx(EXIT_FAILURE, "cannot save local required by list");
+}
+
+/*
+ * Write the +REQUIRED_BY of an installed package from LOCAL_REQUIRED_BY,
+ * through a temporary file so that it is replaced in one go, or remove it if
+ * the package is no longer required by anything.
+ */
+static int
+write_required_by(sqlite3_stmt *stmt, const char *pkgname)
+{
+	FILE *fp = NULL;
+	char *path, *tmppath;
+	int rc = EXIT_SUCCESS;
+
+	path = pkgdb_pkg_file(pkgname, REQUIRED_BY_FNAME);
+	tmppath = pkgdb_pkg_file(pkgname, REQUIRED_BY_FNAME_TMP);
+
+	if (sqlite3_bind_text(stmt, 1, pkgname, -1, SQLITE_STATIC)
+	    != SQLITE_OK)
+		errx(EXIT_FAILURE, "Failed to bind %s", pkgname);
+
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		if (fp == NULL && (fp = fopen(tmppath, "w")) == NULL) {
+			warn("%s", tmppath);
+			rc = EXIT_FAILURE;
+			break;
+		}
+		fprintf(fp, "%s\n", (const char *)sqlite3_column_text(stmt, 0));
+	}
+	(void)sqlite3_reset(stmt);
+
+	if (fp != NULL) {
+		if (fclose(fp) != 0 || rename(tmppath, path) == -1) {
+			warn("%s", path);
+			(void)unlink(tmppath);
+			rc = EXIT_FAILURE;
+		}
+	} else if (rc == EXIT_SUCCESS && unlink(path) == -1 &&
+	    errno != ENOENT) {
+		warn("%s", path);
+		rc = EXIT_FAILURE;
+	}
+
+	free(path);
+	free(tmppath);
+
+	return rc;
+}
+
+/*
+ * qsort callback to sort +REQUIRED_BY entries alphabetically.
+ */
+static int
+sort_required_by(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * Read the +REQUIRED_BY of an installed package as a sorted list, so that it
+ * compares equal however its entries were ordered.  Returns an empty string
+ * if it does not exist.
+ */
+static char *
+read_required_by(const char *pkgname)
+{
+	FILE *fp;
+	char *path, *line = NULL, *buf, **lines = NULL;
+	size_t len = 0, i, nlines = 0, size = 1;
+	ssize_t llen;
+
+	path = pkgdb_pkg_file(pkgname, REQUIRED_BY_FNAME);
+	if ((fp = fopen(path, "r")) != NULL) {
+		while ((llen = getline(&line, &len, fp)) > 0) {
+			if (line[llen - 1] == '\n')
+				line[--llen] = '\0';
+			if (llen == 0)
+				continue;
+			lines = xrealloc(lines, (nlines + 1) * sizeof(char *));
+			lines[nlines++] = xstrdup(line);
+			size += llen + 1;
+		}
+		fclose(fp);
+	}
+	free(line);
+	free(path);
+
+	qsort(lines, nlines, sizeof(char *), sort_required_by);
+
+	buf = xmalloc(size);
+	buf[0] = '\0';
+	for (i = 0; i < nlines; i++) {
+		strcat(buf, lines[i]);
+		strcat(buf, "\n");
+		free(lines[i]);
+	}
+	free(lines);
+
+	return buf;
+}
+
+/*
+ * Compare every +REQUIRED_BY against the output of "pkg_admin rebuild-tree",
+ * which rewrites them all, logging each one that differs along with any
+ * warnings from pkg_admin.
+ */
+static int
+verify_required_by(void)
+{
+	Pkglist *p;
+	char **saved = NULL;
+	char *rebuilt;
+	size_t n, npkgs = 0;
+	int i, rc = EXIT_SUCCESS;
+
+	for (i = 0; i < LOCAL_PKG_HASH_SIZE; i++) {
+		SLIST_FOREACH(p, &l_plisthead[i], next) {
+			saved = xrealloc(saved, (npkgs + 1) * sizeof(char *));
+			saved[npkgs++] = read_required_by(p->full);
+		}
+	}
+
+	open_pi_log();
+
+	if (rebuild_required_by() != EXIT_SUCCESS)
+		rc = EXIT_FAILURE;
+
+	n = 0;
+	for (i = 0; i < LOCAL_PKG_HASH_SIZE; i++) {
+		SLIST_FOREACH(p, &l_plisthead[i], next) {
+			rebuilt = read_required_by(p->full);
+			if (strcmp(saved[n], rebuilt) != 0) {
+				warnx("+REQUIRED_BY of %s differs from "
+				    "pkg_admin rebuild-tree", p->full);
+				rc = EXIT_FAILURE;
+			}
+			free(rebuilt);
+			free(saved[n++]);
+		}
+	}
+	free(saved);
+
+	close_pi_log(0);
+
+	return rc;
+}
+
+/*
+ * Write the +REQUIRED_BY files of the installed packages whose entries in
+ * LOCAL_REQUIRED_BY changed since save_required_by(), which must follow
+ * update_db() so that those reflect the packages that were just installed or
+ * removed.  These are the only ones the transaction could have affected, so
+ * there is no need for "pkg_admin rebuild-tree" to rewrite every one, except
+ * to verify the result if PKGIN_VERIFY_REQUIRED_BY is set.
+ */
+static int
+update_required_by(void)
+{
+	sqlite3_stmt *changed, *reqd_by;
+	int rc = EXIT_SUCCESS;
+
+	changed = pkgindb_stmt_prepare(SELECT_REQUIRED_BY_CHANGED);
+	reqd_by = pkgindb_stmt_prepare(SELECT_REQUIRED_BY);
+
+	while (sqlite3_step(changed) == SQLITE_ROW) {
+		if (write_required_by(reqd_by,
+		    (const char *)sqlite3_column_text(changed, 0))
+		    != EXIT_SUCCESS)
+			rc = EXIT_FAILURE;
+	}
+
+	pkgindb_stmt_finalize(reqd_by);
+	pkgindb_stmt_finalize(changed);
+
+	if (getenv("PKGIN_VERIFY_REQUIRED_BY") != NULL &&
+	    verify_required_by() != EXIT_SUCCESS)
+		rc = EXIT_FAILURE;
+
+	return rc;
+}
+
 /*
  * Remove a list of packages.  The package list may contain entries that are
  * not removals.
@@ -888,6 +1077,8 @@ pkgin_install(char **pkgargs, int do_inst, int upgrade)
 	if (refreshnum + upgradenum + installnum == 0)
 		goto installend;
 
+	save_required_by();
+
 	/*
 	 * Perform any removals first.  Any superseded packages are highly
 	 * likely to conflict with incoming newer packages.
@@ -900,17 +1091,17 @@ pkgin_install(char **pkgargs, int do_inst, int upgrade)
 	if (do_pkg_install(installhead) == EXIT_FAILURE)
 		rc = EXIT_FAILURE;
 
+	(void)update_db(LOCAL_SUMMARY, 1);
+
 	/*
 	 * Recalculate +REQUIRED_BY entries after all installs have finished,
 	 * as things can get out of sync when using pkg_add -DU, leading to the
 	 * dreaded "Can't open +CONTENTS of depending package..." errors when
 	 * upgrading next time.
 	 */
-	if (rebuild_required_by() != EXIT_SUCCESS)
+	if (update_required_by() != EXIT_SUCCESS)
 		rc = EXIT_FAILURE;
 
-	(void)update_db(LOCAL_SUMMARY, 1);
-
 	/*
 	 * If we only upgraded the package tools and it was successful then
 	 * print a message about performing the subsequent full upgrade.
@@ -997,16 +1188,16 @@ pkgin_remove(char **pkgargs)
 		if (!noflag)
 			printf("\n");
 		if (check_yesno(DEFAULT_YES)) {
+			save_required_by();
 			do_pkg_remove(removehead);
+			(void)update_db(LOCAL_SUMMARY, 1);
 
 			/*
 			 * Recalculate +REQUIRED_BY entries in case anything
 			 * has been unable to update correctly.
 			 */
-			if (rebuild_required_by() != EXIT_SUCCESS)
+			if (update_required_by() != EXIT_SUCCESS)
 				rc = EXIT_FAILURE;
-
-			(void)update_db(LOCAL_SUMMARY, 1);
 		}
 	} else
 		printf(MSG_NO_PKGS_TO_DELETE);
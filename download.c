@@ -27,32 +27,66 @@
  * SUCH DAMAGE.
  */
 
+#include <sys/ioctl.h>
+
 #include "pkgin.h"
 #include "external/progressmeter.h"
 
+/*
+ * libfetch reports errors through fetchLastErrCode and fetchLastErrString,
+ * which are shared by every thread.  The requests themselves are made
+ * unlocked so that a slow or dead mirror does not hold up the others, and
+ * the fetch threads only serialise copying the error out once a call has
+ * failed.  libfetch sets it just before returning, so another thread can
+ * only overwrite it if it fails in that same short window.
+ */
+static pthread_mutex_t fetch_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /*
  * Open a pkg_summary and if newer than local return an open libfetch
- * connection to it.
+ * connection to it.  This is called from the per-repository fetch threads, so
+ * must not touch the database or exit on errors other than those that are
+ * fatal to the entire run.
+ *
+ * The request is made conditional on the modification time of the previous
+ * import, so an up-to-date repository costs a single "304 Not Modified"
+ * round trip and no body.  Servers that ignore If-Modified-Since are caught by
+ * comparing the returned time, and for those that send no Last-Modified at all
+ * the size of the previous summary is the only validator left.  A db_mtime of
+ * 0 and db_size of -1 force the download.  On return *db_mtime is -1 if the
+ * summary is up-to-date, and on failure the libfetch error is copied to errbuf.
  */
 Sumfile *
-sum_open(char *str_url, time_t *db_mtime)
+sum_open(char *str_url, time_t *db_mtime, off_t db_size, char *errbuf,
+    size_t errlen)
 {
 	Sumfile		*sum = NULL;
 	fetchIO		*f = NULL;
 	struct url	*url;
 	struct url_stat	st;
+	char		flags[sizeof(fetchflags) + 1];
+	int		unchanged;
 
-	url = fetchParseURL(str_url);
+	if ((url = fetchParseURL(str_url)) == NULL) {
+		snprintf(errbuf, errlen, "invalid URL");
+		return NULL;
+	}
 
-	if (url == NULL || (f = fetchXGet(url, &st, fetchflags)) == NULL)
-		goto nofetch;
+	snprintf(flags, sizeof(flags), "%si", fetchflags);
+	url->last_modified = (*db_mtime > 0) ? *db_mtime : 0;
 
-	if (st.size == -1) { /* could not obtain file size */
-		*db_mtime = 0; /* not -1, don't force update */
+	if ((f = fetchXGet(url, &st, flags)) == NULL) {
+		pthread_mutex_lock(&fetch_lock);
+		unchanged = (fetchLastErrCode == FETCH_UNCHANGED);
+		snprintf(errbuf, errlen, "%s", fetchLastErrString);
+		pthread_mutex_unlock(&fetch_lock);
+		if (unchanged)
+			*db_mtime = -1;
 		goto nofetch;
 	}
 
-	if (st.mtime <= *db_mtime) {
+	if (st.mtime > 0 ? st.mtime <= *db_mtime :
+	    st.size > 0 && st.size == db_size) {
 		/*
 		 * -1 used to identify return type,
 		 * local summary up-to-date
@@ -61,7 +95,7 @@ sum_open(char *str_url, time_t *db_mtime)
 		goto nofetch;
 	}
 
-	*db_mtime = st.mtime;
+	*db_mtime = (st.mtime > 0) ? st.mtime : 0;
 
 	/* st.size is an off_t, it will be > SSIZE_MAX on 32 bits systems */
 	if (sizeof(st.size) == sizeof(SSIZE_MAX) && st.size > SSIZE_MAX - 1)
@@ -84,73 +118,351 @@ out:
 }
 
 /*
- * archive_read_open open callback.  As we already have an open
- * libfetch handler all we need to do is print the download messages.
+ * Read the remainder of an open pkg_summary into memory, reporting progress
+ * to the repository view as we go.  The compressed summary is small enough
+ * that buffering it in full is cheaper than holding the connection open while
+ * the database writer is busy with another repository.
  */
-int
-sum_start(struct archive *a, void *data)
+char *
+sum_fetch(Sumfile *sum, Sumrepo *repo, size_t *len)
 {
-	Sumfile	*sum = data;
-	char	*p;
+	ssize_t	fetched;
+	size_t	buflen;
+	char	*buf;
 
-	if ((p = strrchr(sum->url->doc, '/')) != NULL)
-		p++;
-	else
-		p = (char *)sum->url->doc; /* should not happen */
+	buflen = (sum->size > 0) ? (size_t)sum->size : 65536;
+	buf = xmalloc(buflen);
 
-	if (parsable)
-		printf("downloading %s", p);
-	else {
-		printf("downloading %s:   0%%", p);
-		fflush(stdout);
-		start_progress_meter(p, sum->size, &sum->pos);
+	for (;;) {
+		if ((size_t)sum->pos == buflen) {
+			buflen *= 2;
+			buf = xrealloc(buf, buflen);
+		}
+
+		fetched = fetchIO_read(sum->fd, buf + sum->pos,
+		    buflen - (size_t)sum->pos);
+
+		if (fetched == 0)
+			break;
+		if (fetched < 0 && errno == EINTR)
+			continue;
+		if (fetched < 0) {
+			pthread_mutex_lock(&fetch_lock);
+			sumview_fail(repo, "failure during fetch of file: %s",
+			    fetchLastErrString);
+			pthread_mutex_unlock(&fetch_lock);
+			free(buf);
+			return NULL;
+		}
+
+		sum->pos += fetched;
+		sumview_progress(repo, sum->pos);
+	}
+
+	if (sum->size > 0 && sum->pos != sum->size) {
+		sumview_fail(repo, "%s truncated", sum->url->doc);
+		free(buf);
+		return NULL;
 	}
 
-	return ARCHIVE_OK;
+	*len = (size_t)sum->pos;
+
+	return buf;
+}
+
+void
+sum_close(Sumfile *sum)
+{
+	fetchIO_close(sum->fd);
+	fetchFreeURL(sum->url);
+	XFREE(sum);
 }
 
 /*
- * archive_read_open read callback.  Read the next chunk of data from libfetch
- * and update the read position for the progress meter.
+ * Repository view.  While "pkgin update" is running every repository is in
+ * one of the sumstate_t states, and the view shows all of them at once.  On a
+ * terminal the view is a block of lines redrawn in place by a separate thread,
+ * otherwise (or with -p) a line is printed for each state change.
+ *
+ * The same lock protects the state of each repository, so the database writer
+ * also uses it to wait for repositories to be fetched.
  */
-ssize_t
-sum_read(struct archive *a, void *data, const void **buf)
+static pthread_mutex_t	sumview_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	sumview_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t	sumview_tid;
+static Sumrepo		*sumview_repos;
+static int		sumview_count;
+static int		sumview_verbose;
+static int		sumview_active;	/* view thread is running */
+static int		sumview_paused;
+static int		sumview_drawn;	/* lines to move up on next redraw */
+
+static const char *const sumstates[] = {
+	[SUM_WAITING]	= "waiting",
+	[SUM_FETCHING]	= "downloading",
+	[SUM_DECODING]	= "decompressing",
+	[SUM_IMPORTING]	= "importing",
+	[SUM_DONE]	= "done",
+	[SUM_UPTODATE]	= "up-to-date",
+	[SUM_FAILED]	= "failed",
+};
+
+static void
+sumview_format(Sumrepo *repo, char *buf, size_t len)
 {
-	Sumfile	*sum = data;
-	ssize_t	fetched;
+	char pos[H_BUF], size[H_BUF];
+
+	switch (repo->state) {
+	case SUM_FETCHING:
+		humanize_size(pos, repo->pos);
+		if (!sumview_active) {
+			humanize_size(size, repo->size);
+			snprintf(buf, len, "%s %s%s%s (%s)",
+			    sumstates[repo->state], PKG_SUMMARY,
+			    SUMEXT_DOT(repo->ext), repo->ext,
+			    repo->size > 0 ? size : "unknown size");
+		} else if (repo->size > 0) {
+			humanize_size(size, repo->size);
+			snprintf(buf, len, "%s %s%s%s %3d%% %s/%s",
+			    sumstates[repo->state], PKG_SUMMARY,
+			    SUMEXT_DOT(repo->ext), repo->ext,
+			    (int)((repo->pos * 100) / repo->size), pos, size);
+		} else
+			snprintf(buf, len, "%s %s%s%s %s",
+			    sumstates[repo->state], PKG_SUMMARY,
+			    SUMEXT_DOT(repo->ext), repo->ext, pos);
+		break;
+	case SUM_DECODING:
+		if (repo->replay)
+			snprintf(buf, len, "%s saved %s%s%s",
+			    sumstates[repo->state], PKG_SUMMARY,
+			    SUMEXT_DOT(repo->ext), repo->ext);
+		else
+			snprintf(buf, len, "%s", sumstates[repo->state]);
+		break;
+	case SUM_DONE:
+		snprintf(buf, len, "%s: %d added, %d updated, %d removed",
+		    sumstates[repo->state], repo->diff.added,
+		    repo->diff.rebuilt, repo->diff.removed);
+		if (repo->filter != NULL)
+			snprintf(buf + strlen(buf), len - strlen(buf),
+			    ", %d not subscribed", repo->diff.filtered);
+		break;
+	case SUM_FAILED:
+		snprintf(buf, len, "%s: %s", sumstates[repo->state],
+		    repo->errmsg);
+		break;
+	default:
+		snprintf(buf, len, "%s", sumstates[repo->state]);
+		break;
+	}
+}
 
-	*buf = sum->buf;
+/*
+ * Redraw the full view.  Called with sumview_lock held.
+ */
+static void
+sumview_draw(void)
+{
+	struct winsize	ws;
+	int		i, len, room, width = 80;
+	char		*url, state[BUFSIZ];
 
-	fetched = fetchIO_read(sum->fd, sum->buf, sizeof(sum->buf));
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0)
+		width = ws.ws_col;
 
-	if (fetched == -1)
-		errx(EXIT_FAILURE, "failure during fetch of file: %s",
-		    fetchLastErrString);
+	if (sumview_drawn)
+		printf("\033[%dA", sumview_drawn);
 
-	sum->pos += fetched;
+	for (i = 0; i < sumview_count; i++) {
+		url = sumview_repos[i].url;
+		sumview_format(&sumview_repos[i], state, sizeof(state));
 
-	return fetched;
+		/*
+		 * Repository URLs tend to share a common prefix, so if there
+		 * isn't room for the full URL show the end of it instead.
+		 */
+		room = width - 2 - (int)strlen(state);
+		len = (int)strlen(url);
+		if (room < 4)
+			printf("\r\033[K%.*s\n", width - 1, state);
+		else if (len > room)
+			printf("\r\033[K...%s %s\n", url + len - room + 3,
+			    state);
+		else
+			printf("\r\033[K%-*s %s\n", room, url, state);
+	}
+	fflush(stdout);
+
+	sumview_drawn = sumview_count;
+}
+
+static void *
+sumview_thread(void *arg)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&sumview_lock);
+	while (sumview_active) {
+		if (!sumview_paused)
+			sumview_draw();
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 250 * 1000 * 1000;
+		if (ts.tv_nsec >= 1000 * 1000 * 1000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000 * 1000 * 1000;
+		}
+		(void) pthread_cond_timedwait(&sumview_cond, &sumview_lock,
+		    &ts);
+	}
+	sumview_draw();
+	pthread_mutex_unlock(&sumview_lock);
+
+	return NULL;
+}
+
+void
+sumview_start(Sumrepo *repos, int count, int verbose)
+{
+	sumview_repos = repos;
+	sumview_count = count;
+	sumview_verbose = verbose;
+	sumview_drawn = 0;
+	sumview_paused = 0;
+
+	/*
+	 * Only use the interactive view for a verbose update on a terminal.
+	 */
+	if (!verbose || parsable)
+		return;
+
+	sumview_active = 1;
+	if (pthread_create(&sumview_tid, NULL, sumview_thread, NULL) != 0)
+		sumview_active = 0;
+}
+
+void
+sumview_stop(void)
+{
+	pthread_mutex_lock(&sumview_lock);
+	if (!sumview_active) {
+		pthread_mutex_unlock(&sumview_lock);
+		return;
+	}
+	sumview_active = 0;
+	pthread_cond_broadcast(&sumview_cond);
+	pthread_mutex_unlock(&sumview_lock);
+
+	pthread_join(sumview_tid, NULL);
 }
 
 /*
- * archive_read_open close callback.  Stop the progress meter and close the
- * libfetch handler.
+ * Temporarily stop redrawing, for example to ask the user a question, and
+ * start again afterwards with a fresh view below whatever was printed.
  */
-int
-sum_close(struct archive *a, void *data)
+void
+sumview_suspend(void)
 {
-	Sumfile	*sum = data;
+	pthread_mutex_lock(&sumview_lock);
+	sumview_paused = 1;
+	pthread_mutex_unlock(&sumview_lock);
+}
 
-	if (parsable)
-		printf(" done.\n");
-	else
-		stop_progress_meter();
+void
+sumview_resume(void)
+{
+	pthread_mutex_lock(&sumview_lock);
+	sumview_paused = 0;
+	sumview_drawn = 0;
+	pthread_mutex_unlock(&sumview_lock);
+}
 
-	fetchIO_close(sum->fd);
-	fetchFreeURL(sum->url);
-	XFREE(sum);
+/*
+ * Without the interactive view, print a line for each state change that is
+ * of interest.  Up-to-date repositories are only shown for verbose updates.
+ * Called with sumview_lock held.
+ */
+static void
+sumview_print(Sumrepo *repo)
+{
+	char state[BUFSIZ];
+
+	if (sumview_active)
+		return;
+
+	switch (repo->state) {
+	case SUM_FETCHING:
+	case SUM_FAILED:
+		break;
+	case SUM_DECODING:
+		if (repo->replay)
+			break;
+		return;
+	case SUM_IMPORTING:
+	case SUM_DONE:
+	case SUM_UPTODATE:
+		if (sumview_verbose)
+			break;
+		return;
+	default:
+		return;
+	}
+
+	sumview_format(repo, state, sizeof(state));
+	printf("%s: %s\n", repo->url, state);
+	fflush(stdout);
+}
+
+void
+sumview_set(Sumrepo *repo, sumstate_t state)
+{
+	pthread_mutex_lock(&sumview_lock);
+	/* A failure in any stage is final. */
+	if (repo->state != SUM_FAILED)
+		repo->state = state;
+	sumview_print(repo);
+	pthread_cond_broadcast(&sumview_cond);
+	pthread_mutex_unlock(&sumview_lock);
+}
+
+void
+sumview_fail(Sumrepo *repo, const char *fmt, ...)
+{
+	va_list ap;
+
+	pthread_mutex_lock(&sumview_lock);
+	va_start(ap, fmt);
+	vsnprintf(repo->errmsg, sizeof(repo->errmsg), fmt, ap);
+	va_end(ap);
+	repo->state = SUM_FAILED;
+	sumview_print(repo);
+	pthread_cond_broadcast(&sumview_cond);
+	pthread_mutex_unlock(&sumview_lock);
+}
+
+void
+sumview_progress(Sumrepo *repo, off_t pos)
+{
+	pthread_mutex_lock(&sumview_lock);
+	repo->pos = pos;
+	pthread_mutex_unlock(&sumview_lock);
+}
+
+/*
+ * Wait for a repository to finish fetching, returning its new state.
+ */
+sumstate_t
+sumview_wait(Sumrepo *repo)
+{
+	sumstate_t state;
+
+	pthread_mutex_lock(&sumview_lock);
+	while (repo->state == SUM_WAITING || repo->state == SUM_FETCHING)
+		pthread_cond_wait(&sumview_cond, &sumview_lock);
+	state = repo->state;
+	pthread_mutex_unlock(&sumview_lock);
 
-	return ARCHIVE_OK;
+	return state;
 }
 
 /*
@@ -104,10 +104,14 @@
 /* summary.c */
 #define MSG_READING_LOCAL_SUMMARY "reading local summary...\n"
 #define MSG_CLEANING_DB_FROM_REPO "cleaning database from %s entries...\n"
+#define MSG_REPO_NOT_SHARED \
+	"%s is in the shared catalog %s but not configured here.\n" \
+	"All roots sharing it must use the same repositories, " \
+	"then run \"pkgin -f update\"."
 #define MSG_PROCESSING_LOCAL_SUMMARY "processing local summary...\n"
-#define MSG_DB_IS_UP_TO_DATE "database for %s is up-to-date\n"
-#define MSG_PROCESSING_REMOTE_SUMMARY "processing remote summary (%s)...\n"
 #define MSG_COULDNT_FETCH "Could not fetch %s: %s"
+#define MSG_REPOS_FAILED "%d repositories could not be updated"
+#define MSG_BAD_SUBSCRIPTION PKGIN_CONF"/"SUBS_FILE": invalid line %d"
 #define MSG_ARCH_DONT_MATCH "\r\n/!\\ Warning /!\\ %s doesn't match your current architecture (%s)\nYou probably want to modify "PKGIN_CONF"/"REPOS_FILE".\nStill want to "
 
 /* impact.c */
@@ -27,38 +27,424 @@
  * SUCH DAMAGE.
  */
 
+#include <sqlite3.h>
 #include "pkgin.h"
 
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+/*
+ * Historically pkgin skipped blank lines, so we preserve that behaviour for
+ * now.
+ */
+static void
+print_lines(char *text)
+{
+	char	*line, *nl;
+
+	for (line = text; *line != '\0'; line = nl) {
+		if ((nl = strchr(line, '\n')) == NULL)
+			nl = line + strlen(line);
+		else
+			*nl++ = '\0';
+		if (*line != '\0')
+			printf("%s\n", line);
+	}
+}
+
+/*
+ * Return the text of a description that was deflated at import time.
+ */
+static char *
+inflate_description(const void *data, size_t len, size_t size)
+{
+#ifdef HAVE_ZLIB
+	z_stream	zs;
+	char		*text;
+	int		rc;
+
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit2(&zs, -15) != Z_OK)
+		return NULL;
+
+	text = xmalloc(size + 1);
+	zs.next_in = (Bytef *)(uintptr_t)data;
+	zs.avail_in = (uInt)len;
+	zs.next_out = (Bytef *)text;
+	zs.avail_out = (uInt)size;
+	rc = inflate(&zs, Z_FINISH);
+	(void) inflateEnd(&zs);
+
+	if (rc != Z_STREAM_END || zs.total_out != size) {
+		free(text);
+		return NULL;
+	}
+	text[size] = '\0';
+
+	return text;
+#else
+	return NULL;
+#endif
+}
+
+/*
+ * The DESCRIPTION of every remote package is stored when its repository is
+ * imported, so unlike the other information it does not need the package
+ * to be downloaded.  The output is the same as pkg_info -d.
+ */
+static int
+show_pkg_descr(const char *fullpkgname)
+{
+	sqlite3_stmt	*stmt;
+	const char	*repo, *data;
+	size_t		len;
+	int64_t		size;
+	int		rv = -1;
+	char		*text;
+
+	stmt = pkgindb_stmt_prepare(SELECT_REMOTE_DESCRIPTION);
+	if (sqlite3_bind_text(stmt, 1, fullpkgname, -1, SQLITE_STATIC)
+	    != SQLITE_OK)
+		errx(EXIT_FAILURE, "Failed to bind %s", fullpkgname);
+
+	if (sqlite3_step(stmt) != SQLITE_ROW)
+		goto out;
+
+	repo = (const char *)sqlite3_column_text(stmt, 0);
+	size = sqlite3_column_int64(stmt, 1);
+	data = sqlite3_column_blob(stmt, 2);
+	len = (size_t)sqlite3_column_bytes(stmt, 2);
+
+	if (sqlite3_column_type(stmt, 2) == SQLITE_NULL) {
+		warnx("%s has no description", fullpkgname);
+		goto out;
+	}
+
+	if (size > 0) {
+		if ((text = inflate_description(data, len, (size_t)size))
+		    == NULL) {
+			warnx("cannot read the description of %s",
+			    fullpkgname);
+			goto out;
+		}
+	} else {
+		text = xmalloc(len + 1);
+		if (len > 0)
+			memcpy(text, data, len);
+		text[len] = '\0';
+	}
+
+	printf("Information for %s/%s%s:\n", repo ? repo : "", fullpkgname,
+	    PKG_EXT);
+	printf("Description:\n");
+
+	print_lines(text);
+	free(text);
+	rv = 0;
+out:
+	pkgindb_stmt_finalize(stmt);
+	return rv != 0;
+}
+
+/*
+ * The other information comes from the + metadata files of the binary
+ * package.  These are at the front of the archive, so rather than have
+ * pkg_info download the whole package it is streamed here and the transfer
+ * is dropped as soon as the wanted file has been read.
+ */
+struct pkg_stream {
+	fetchIO		*f;
+	struct archive	*outer;
+	char		buf[32768];
+};
+
+static ssize_t
+pkg_stream_read(struct archive *a, void *cookie, const void **buf)
+{
+	struct pkg_stream	*ps = cookie;
+	ssize_t			n;
+
+	(void)a;
+	*buf = ps->buf;
+
+	if (ps->outer != NULL)
+		return archive_read_data(ps->outer, ps->buf, sizeof(ps->buf));
+
+	do {
+		n = fetchIO_read(ps->f, ps->buf, sizeof(ps->buf));
+	} while (n < 0 && errno == EINTR);
+
+	return n;
+}
+
+static struct archive *
+pkg_archive_new(void)
+{
+	struct archive	*a;
+
+	if ((a = archive_read_new()) == NULL)
+		errx(EXIT_FAILURE, "Cannot initialise archive");
+
+#if ARCHIVE_VERSION_NUMBER < 3000000
+	archive_read_support_compression_all(a);
+#else
+	archive_read_support_filter_all(a);
+#endif
+	archive_read_support_format_ar(a);
+	archive_read_support_format_tar(a);
+
+	return a;
+}
+
+/*
+ * Read the metadata file meta from the package opened in a.  A signed
+ * package is an ar archive holding its hash and signature along with the
+ * package itself, which is then read through a second archive.
+ *
+ * Return 0 with the contents in data, 1 if the package does not have this
+ * file, or -1 if it could not be read.
+ */
+static int
+read_pkg_meta(struct archive *a, const char *src, const char *meta,
+    char **data)
+{
+	struct archive_entry	*ae;
+	struct archive		*pkg = a;
+	struct pkg_stream	inner;
+	const char		*name;
+	size_t			len = 0, size = 0;
+	ssize_t			n = 0;
+	int			rc, rv = -1;
+
+	*data = NULL;
+	memset(&inner, 0, sizeof(inner));
+
+	while ((rc = archive_read_next_header(pkg, &ae)) == ARCHIVE_OK ||
+	    rc == ARCHIVE_WARN) {
+		name = archive_entry_pathname(ae);
+
+		if (pkg == a && (archive_format(a) & ARCHIVE_FORMAT_BASE_MASK)
+		    == ARCHIVE_FORMAT_AR) {
+			if (name[0] == '+' || name[0] == '/')
+				continue;
+			inner.outer = a;
+			pkg = pkg_archive_new();
+			if (archive_read_open(pkg, &inner, NULL,
+			    pkg_stream_read, NULL) != ARCHIVE_OK)
+				break;
+			continue;
+		}
+
+		if (strcmp(name, meta) != 0) {
+			if (name[0] != '+') {
+				rv = 1;
+				break;
+			}
+			continue;
+		}
+
+		for (;;) {
+			if (size - len < sizeof(inner.buf)) {
+				size = size ? size * 2 : sizeof(inner.buf);
+				*data = xrealloc(*data, size + 1);
+			}
+			if ((n = archive_read_data(pkg, *data + len,
+			    size - len)) <= 0)
+				break;
+			len += (size_t)n;
+		}
+		if (n == 0) {
+			(*data)[len] = '\0';
+			rv = 0;
+		}
+		break;
+	}
+
+	if (rc == ARCHIVE_EOF)
+		rv = 1;
+	if (rv < 0)
+		warnx("%s: %s", src, archive_error_string(pkg));
+	if (rv != 0) {
+		free(*data);
+		*data = NULL;
+	}
+	if (pkg != a)
+		archive_read_free(pkg);
+
+	return rv;
+}
+
+/*
+ * Read meta from the package at src, which is either a URL or a file in the
+ * package cache.
+ */
+static int
+fetch_pkg_meta(const char *src, int cached, const char *meta, char **data)
+{
+	struct archive		*a;
+	struct pkg_stream	ps;
+	struct url		*url;
+	struct url_stat		st;
+	int			rv = -1;
+
+	memset(&ps, 0, sizeof(ps));
+	a = pkg_archive_new();
+
+	if (cached) {
+		if (archive_read_open_filename(a, src, sizeof(ps.buf))
+		    == ARCHIVE_OK)
+			rv = read_pkg_meta(a, src, meta, data);
+		else
+			warnx("%s: %s", src, archive_error_string(a));
+		archive_read_free(a);
+		return rv;
+	}
+
+	if ((url = fetchParseURL(src)) == NULL)
+		errx(EXIT_FAILURE, "%s: parse failure", src);
+	ps.f = fetchXGet(url, &st, fetchflags);
+	fetchFreeURL(url);
+
+	if (ps.f == NULL)
+		warnx("%s: %s", src, fetchLastErrString);
+	else if (archive_read_open(a, &ps, NULL, pkg_stream_read, NULL)
+	    != ARCHIVE_OK)
+		warnx("%s: %s", src, archive_error_string(a));
+	else
+		rv = read_pkg_meta(a, src, meta, data);
+
+	archive_read_free(a);
+	if (ps.f != NULL)
+		fetchIO_close(ps.f);
+
+	return rv;
+}
+
+/*
+ * The file list of +CONTENTS as shown by pkg_info -L.
+ */
+static void
+print_contents(char *text)
+{
+	const char	*dir = ".";
+	char		*line, *nl;
+	int		ignore = 0;
+
+	for (line = text; *line != '\0'; line = nl) {
+		if ((nl = strchr(line, '\n')) == NULL)
+			nl = line + strlen(line);
+		else
+			*nl++ = '\0';
+
+		if (*line != '@') {
+			if (*line != '\0' && !ignore)
+				printf("%s%s%s\n", dir,
+				    strcmp(dir, "/") == 0 ? "" : "/", line);
+			ignore = 0;
+		} else if (strncmp(line, "@cwd ", 5) == 0 ||
+		    strncmp(line, "@cd ", 4) == 0)
+			dir = strchr(line, ' ') + 1;
+		else if (strcmp(line, "@ignore") == 0)
+			ignore = 1;
+	}
+}
+
+/*
+ * Show +CONTENTS or +BUILD_INFO in the same format as pkg_info -L and -B.
+ * A copy in the package cache is used if there is one, otherwise the
+ * repositories are tried in the order they are configured until one can be
+ * read, starting with those providing the package.
+ */
+static int
+show_pkg_meta(char flag, const char *fullpkgname)
+{
+	sqlite3_stmt	*stmt;
+	struct stat	st;
+	const char	*meta;
+	char		**repos = NULL, **prepos, *src, *data = NULL;
+	int64_t		*sizes = NULL;
+	int		i, n = 0, pass, rv = -1;
+
+	meta = (flag == 'L') ? "+CONTENTS" : "+BUILD_INFO";
+
+	stmt = pkgindb_stmt_prepare(SELECT_REMOTE_PKG_FILE);
+	if (sqlite3_bind_text(stmt, 1, fullpkgname, -1, SQLITE_STATIC)
+	    != SQLITE_OK)
+		errx(EXIT_FAILURE, "Failed to bind %s", fullpkgname);
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		repos = xrealloc(repos, (n + 1) * sizeof(char *));
+		sizes = xrealloc(sizes, (n + 1) * sizeof(int64_t));
+		repos[n] = xstrdup((const char *)sqlite3_column_text(stmt, 0));
+		sizes[n++] = sqlite3_column_int64(stmt, 1);
+	}
+	pkgindb_stmt_finalize(stmt);
+
+	if (n == 0)
+		errx(EXIT_FAILURE, MSG_PKG_NO_REPO, fullpkgname);
+
+	src = xasprintf("%s/%s%s", pkgin_cache, fullpkgname, PKG_EXT);
+	if (stat(src, &st) == 0) {
+		for (i = 0; i < n; i++)
+			if (sizes[i] <= 0 || sizes[i] == st.st_size)
+				break;
+		if (i < n)
+			rv = fetch_pkg_meta(src, 1, meta, &data);
+	}
+
+	/*
+	 * The first pass only tries the repositories that the package was
+	 * imported from, the second any others that might also have it.
+	 */
+	for (pass = 0; rv < 0 && pass < 2; pass++) {
+		for (prepos = pkg_repos; rv < 0 && *prepos != NULL; prepos++) {
+			for (i = 0; i < n; i++)
+				if (strcmp(*prepos, repos[i]) == 0)
+					break;
+			if ((i < n) != (pass == 0))
+				continue;
+			free(src);
+			src = xasprintf("%s/%s%s", *prepos, fullpkgname,
+			    PKG_EXT);
+			rv = fetch_pkg_meta(src, 0, meta, &data);
+		}
+	}
+
+	if (rv == 0) {
+		printf("Information for %s:\n", src);
+		if (flag == 'L') {
+			printf("Files:\n");
+			print_contents(data);
+		} else {
+			printf("Build information:\n");
+			print_lines(data);
+		}
+		free(data);
+	} else if (rv > 0)
+		warnx("%s has no %s", src, meta);
+
+	for (i = 0; i < n; i++)
+		free(repos[i]);
+	free(repos);
+	free(sizes);
+	free(src);
+
+	return rv != 0;
+}
+
 int
 show_pkg_info(char flag, char *pkgname)
 {
-	FILE	*fp;
-	int	rv = 0;
-	char	buf[MAXLEN], cmd[BUFSIZ], *fullpkgname, **prepos;
+	char	*fullpkgname;
+	int	rv;
 
 	if ((fullpkgname = unique_pkg(pkgname, REMOTE_PKG)) == NULL)
 		errx(EXIT_FAILURE, MSG_PKG_NOT_AVAIL, pkgname);	
 
-	/* loop through PKG_REPOS */
-	for (prepos = pkg_repos; *prepos != NULL; prepos++) {
-		snprintf(cmd, BUFSIZ, "%s -%c %s/%s%s",
-		    pkg_info, flag, *prepos, fullpkgname, PKG_EXT);
-
-	        if ((fp = popen(cmd, "r")) == NULL)
-			return 1;
-
-		/*
-		 * Historically pkgin skipped blank lines, so we preserve
-		 * that behaviour for now.
-		 */
-		while (fgets(buf, MAXLEN, fp) != NULL) {
-			if (buf[0] != '\n')
-				printf("%s", buf);
-		}
-
-		if (pclose(fp) != 0)
-			rv = 1;
-	}
+	if (flag == 'd')
+		rv = show_pkg_descr(fullpkgname);
+	else
+		rv = show_pkg_meta(flag, fullpkgname);
 
 	free(fullpkgname);
 
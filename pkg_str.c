@@ -281,21 +281,23 @@ pkgstrcmp(const char *p1, const char *p2)
 /*
  * To speed up lookups of patterns we use hashes keyed on the package name if
  * available.  This function extracts a single package name from a pattern if
- * that is the only possible package that can satisfy the pattern.
+ * that is the only possible package that can satisfy the pattern, returning
+ * the length of the package name at the start of the pattern, or -1.
  *
  * For example, "foo-[0-9]*" and "foo>1" etc can be guaranteed to only match
  * for the package name "foo", whereas "{foo,bar}-[0-9]*", "fo{o,b}*>1" can
- * not.  The latter return NULL and callers will instead have to traverse the
+ * not.  The latter return -1 and callers will instead have to traverse the
  * entire hash.
  *
  * This is kept relatively conservative as we cannot be sure what creative
  * patterns users may come up with in the future.
  */
 
-char *
+int
 pkgname_from_pattern(const char *pattern)
 {
-	char *p, *pkgname;
+	const char *p;
+	size_t len;
 
 	/*
 	 * Any alternate matches can be immediately discounted.  It may
@@ -303,9 +305,7 @@ pkgname_from_pattern(const char *pattern)
 	 * possible package names to look up in turn.
 	 */
 	if (strpbrk(pattern, "{"))
-		return NULL;
-
-	pkgname = xstrdup(pattern);
+		return -1;
 
 	/*
 	 * Since we discounted alternate matches, any specific version
@@ -317,11 +317,11 @@ pkgname_from_pattern(const char *pattern)
 	 * pkgsrc and highly suspicious, but we do not want to take any
 	 * chances).
 	 */
-	if ((p = strpbrk(pkgname, "<>"))) {
-		*p = '\0';
-		if (strpbrk(pkgname, "[]*"))
-			goto bad;
-		return pkgname;
+	if ((p = strpbrk(pattern, "<>"))) {
+		len = (size_t)(p - pattern);
+		if (strcspn(pattern, "[]*") < len)
+			return -1;
+		return (int)len;
 	}
 
 	/*
@@ -331,16 +331,14 @@ pkgname_from_pattern(const char *pattern)
 	 * somewhere in the package name, or if the package name itself
 	 * contains '-[0-9]*'.
 	 */
-	if ((p = strrchr(pkgname, '[')) && --p > pkgname) {
+	if ((p = strrchr(pattern, '[')) && --p > pattern) {
 		if (strcmp(p, "-[0-9]*") != 0)
-			goto bad;
-		*p = '\0';
-		if (strpbrk(pkgname, "[]*"))
-			goto bad;
-		return pkgname;
+			return -1;
+		len = (size_t)(p - pattern);
+		if (strcspn(pattern, "[]*") < len)
+			return -1;
+		return (int)len;
 	}
 
-bad:
-	free(pkgname);
-	return NULL;
+	return -1;
 }
@@ -47,6 +47,7 @@
 #include <archive_entry.h>
 #include <fetch.h>
 #include <errno.h>
+#include <pthread.h>
 #include "messages.h"
 #include "pkgindb.h"
 #include "tools.h"
@@ -54,10 +55,17 @@
 #include "external/dewey.h"
 
 #define PKG_SUMMARY "pkg_summary"
+/* Separator before a pkg_summary suffix, none for uncompressed */
+#define SUMEXT_DOT(ext) (*(ext) != '\0' ? "." : "")
+/* Days before trying every pkg_summary suffix again, see PKGIN_PROBE_DAYS */
+#define SUM_PROBE_DAYS 7
 #define PKG_EXT ".tgz"
 #define PKGIN_CONF PKG_SYSCONFDIR"/pkgin"
 #define REPOS_FILE "repositories.conf"
 #define PREF_FILE "preferred.conf"
+#define SUBS_FILE "subscriptions.conf"
+/* Published remote catalog, named after REMOTE_DB_VERSION */
+#define CATALOG_FILE "pkgin-catalog-%d.db.gz"
 
 #define LOCAL_SUMMARY 0
 #define REMOTE_SUMMARY 1
@@ -267,11 +275,82 @@ typedef enum action_t {
 typedef struct Sumfile {
 	fetchIO *fd;
 	struct url *url;
-	char buf[65536];
 	off_t size;
 	off_t pos;
 } Sumfile;
 
+/*
+ * State of each repository during an update.  Repositories are fetched
+ * concurrently by their own thread, which then decodes and parses them into
+ * a queue that the database writer imports from.
+ */
+typedef enum sumstate_t {
+	SUM_WAITING,
+	SUM_FETCHING,
+	SUM_DECODING,
+	SUM_IMPORTING,
+	SUM_DONE,
+	SUM_UPTODATE,
+	SUM_FAILED,
+} sumstate_t;
+
+/*
+ * Changes made to the packages of a repository by an update, so that anything
+ * derived from them, for example cached binary packages, can be invalidated.
+ */
+typedef enum sumchange_t {
+	SUMDIFF_ADDED,
+	SUMDIFF_REMOVED,
+	SUMDIFF_REBUILT,
+} sumchange_t;
+
+typedef struct Sumchange {
+	sumchange_t	type;
+	char		*fullpkgname;
+	SLIST_ENTRY(Sumchange) next;
+} Sumchange;
+
+typedef struct Sumdiff {
+	int		added;
+	int		removed;
+	int		rebuilt;
+	int		unchanged;
+	int		filtered;	/* Not subscribed to */
+	SLIST_HEAD(, Sumchange) changes;
+} Sumdiff;
+
+/**
+ * \struct Sumrepo
+ * \brief A repository being updated
+ */
+typedef struct Sumrepo {
+	char		*url;		/* Repository URL */
+	const char	*ext;		/* pkg_summary suffix being fetched */
+	char		*dbext;		/* REPO_EXT, suffix found last time */
+	time_t		probed;		/* REPO_PROBED, last tried all */
+	int		probe;		/* Trying all suffixes this time */
+	time_t		mtime;		/* REPO_MTIME, new if fetched */
+	sumstate_t	state;
+	off_t		size;		/* Download size */
+	off_t		dbsize;		/* REPO_SIZE, size of the last import */
+	off_t		pos;		/* Bytes downloaded so far */
+	char		*data;		/* Fetched, still compressed */
+	size_t		datalen;
+	int		mapped;		/* data is a mapping of a local file */
+	char		*saved;		/* Kept copy to import if unchanged */
+	int		replay;		/* Importing the kept copy instead */
+	char		*filter;	/* Subscription, NULL for everything */
+	char		*dbfilter;	/* REPO_FILTER, last subscription */
+	struct Sumrule	*rules;		/* Parsed from the subscription */
+	int		nrules;
+	struct Sumqueue	*chunks;	/* Decoded text waiting to be parsed */
+	struct Sumqueue	*batches;	/* Parsed, waiting to be written */
+	struct Sumqueue	*spare;		/* Written batches ready for reuse */
+	Sumdiff		diff;		/* What the import changed */
+	char		errmsg[1024];	/* Reason for SUM_FAILED */
+	pthread_t	tid;
+} Sumrepo;
+
 /**
  * \struct Pkglist
  *
@@ -356,10 +435,17 @@ extern Plisthead	r_plisthead[REMOTE_PKG_HASH_SIZE];
 extern FILE		*tracefp;
 
 /* download.c*/
-Sumfile		*sum_open(char *, time_t *);
-int		sum_start(struct archive *, void *);
-ssize_t		sum_read(struct archive *, void *, const void **);
-int		sum_close(struct archive *, void *);
+Sumfile		*sum_open(char *, time_t *, off_t, char *, size_t);
+char		*sum_fetch(Sumfile *, Sumrepo *, size_t *);
+void		sum_close(Sumfile *);
+void		sumview_start(Sumrepo *, int, int);
+void		sumview_stop(void);
+void		sumview_suspend(void);
+void		sumview_resume(void);
+void		sumview_set(Sumrepo *, sumstate_t);
+void		sumview_fail(Sumrepo *, const char *, ...);
+void		sumview_progress(Sumrepo *, off_t);
+sumstate_t	sumview_wait(Sumrepo *);
 off_t		download_pkg(char *, FILE *, int, int);
 /* summary.c */
 int		update_db(int, int);
@@ -435,7 +521,7 @@ Pkglist		*find_local_pkg(const char *, const char *);
 int		exact_pkgfmt(const char *);
 int		version_check(char *, char *);
 int		pkgstrcmp(const char *, const char *);
-char *		pkgname_from_pattern(const char *);
+int		pkgname_from_pattern(const char *);
 /* selection.c */
 void		export_keep(void);
 void		import_keep(int, const char *);
@@ -458,7 +544,11 @@ void		setup_pkg_install(void);
 #define PRIVS_PKGINDB	0x2
 extern char	*pkgin_dbdir;
 extern char	*pkgin_sqldb;
+extern char	*pkgin_remotedir;
+extern char	*pkgin_remotedb;
+extern char	*pkgin_remotedb_new;
 extern char	*pkgin_cache;
+extern char	*pkgin_sumdir;
 extern char	*pkgin_errlog;
 extern char	*pkgin_sqllog;
 void		setup_pkgin_dbdir(void);
@@ -471,6 +561,14 @@ int		pkgindb_dovaquery(const char *, ...);
 struct sqlite3_stmt *pkgindb_stmt_prepare(const char *);
 int		pkgindb_stmt_exec(struct sqlite3_stmt *);
 void		pkgindb_stmt_finalize(struct sqlite3_stmt *);
+int64_t		pkgindb_last_insert_id(void);
+int		pkgindb_changes(void);
+void		pkgindb_remote_lock(void);
+void		pkgindb_remote_unlock(void);
+void		pkgindb_remote_begin(void);
+void		pkgindb_remote_commit(void);
+void		pkgindb_bulk_begin(void);
+void		pkgindb_bulk_end(void);
 uint64_t	pkgindb_savepoint(void);
 void		pkgindb_savepoint_rollback(uint64_t);
 void		pkgindb_savepoint_release(uint64_t);
@@ -479,7 +577,7 @@ void		pkgindb_close(void);
 int		pkg_db_mtime(struct stat *);
 void		pkg_db_update_mtime(struct stat *);
 void		repo_record(char **);
-time_t		pkg_sum_mtime(char *);
+void		pkg_sum_repo(Sumrepo *);
 void		pkgindb_stats(void);
 
 /* preferred.c */
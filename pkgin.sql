@@ -3,29 +3,18 @@ CREATE TABLE [PKGDB] (
 	"PKGDB_NTIME" INTEGER
 );
 
-CREATE TABLE [REPOS] (
-	"REPO_URL" TEXT UNIQUE,
-	"REPO_MTIME" INTEGER
-);
-
-CREATE TABLE [REMOTE_PKG] (
-	"PKG_ID" INTEGER PRIMARY KEY,
-	"FULLPKGNAME" TEXT UNIQUE,
-	"PKGNAME" TEXT,
-	"PKGVERS" TEXT,
-	"BUILD_DATE" TEXT,
-	"COMMENT" TEXT,
-	"LICENSE" TEXT NULL,
-	"PKGTOOLS_VERSION" TEXT,
-	"HOMEPAGE" TEXT NULL,
-	"OS_VERSION" TEXT,
-	"PKGPATH" TEXT,
-	"PKG_OPTIONS" TEXT NULL,
-	"CATEGORIES" TEXT,
-	"SIZE_PKG" TEXT,
-	"FILE_SIZE" TEXT,
-	"OPSYS" TEXT,
-	"REPOSITORY" TEXT
+/*
+ * The modification time of +CONTENTS for each package in the pkgdb, as it was
+ * when the package was last read into LOCAL_PKG, and that of +INSTALLED_INFO
+ * (or -1 if there is none) when its automatic flag was last read.
+ */
+CREATE TABLE local_pkgdb (
+	fullpkgname	TEXT PRIMARY KEY,
+	mtime		INTEGER,
+	ntime		INTEGER,
+	info_mtime	INTEGER,
+	info_ntime	INTEGER,
+	automatic	INTEGER
 );
 
 CREATE TABLE [LOCAL_PKG] (
@@ -62,17 +51,6 @@ CREATE INDEX idx_local_conflicts_pkg_id ON local_conflicts (
 CREATE INDEX idx_local_conflicts_pattern ON local_conflicts (
 	pattern		ASC
 );
-CREATE TABLE remote_conflicts (
-	pkg_id		INTEGER,
-	pattern		TEXT NOT NULL,
-	pkgbase		TEXT
-);
-CREATE INDEX idx_remote_conflicts_pkg_id ON remote_conflicts (
-	pkg_id		ASC
-);
-CREATE INDEX idx_remote_conflicts_pattern ON remote_conflicts (
-	pattern		ASC
-);
 
 /*
  * DEPENDS
@@ -88,17 +66,6 @@ CREATE INDEX idx_local_depends_pkg_id ON local_depends (
 CREATE INDEX idx_local_depends_pattern ON local_depends (
 	pattern		ASC
 );
-CREATE TABLE remote_depends (
-	pkg_id		INTEGER,
-	pattern		TEXT NOT NULL,
-	pkgbase		TEXT
-);
-CREATE INDEX idx_remote_depends_pkg_id ON remote_depends (
-	pkg_id		ASC
-);
-CREATE INDEX idx_remote_depends_pattern ON remote_depends (
-	pattern		ASC
-);
 
 /*
  * PROVIDES
@@ -113,16 +80,6 @@ CREATE INDEX idx_local_provides_pkg_id ON local_provides (
 CREATE INDEX idx_local_provides_filename ON local_provides (
 	filename	ASC
 );
-CREATE TABLE remote_provides (
-	pkg_id		INTEGER,
-	filename	TEXT
-);
-CREATE INDEX idx_remote_provides_pkg_id ON remote_provides (
-	pkg_id		ASC
-);
-CREATE INDEX idx_remote_provides_filename ON remote_provides (
-	filename	ASC
-);
 
 /*
  * REQUIRES
@@ -137,31 +94,6 @@ CREATE INDEX idx_local_requires_pkg_id ON local_requires (
 CREATE INDEX idx_local_requires_filename ON local_requires (
 	filename	ASC
 );
-CREATE TABLE remote_requires (
-	pkg_id		INTEGER,
-	filename	TEXT
-);
-CREATE INDEX idx_remote_requires_pkg_id ON remote_requires (
-	pkg_id		ASC
-);
-CREATE INDEX idx_remote_requires_filename ON remote_requires (
-	filename	ASC
-);
-
-/*
- * SUPERSEDES
- */
-CREATE TABLE remote_supersedes (
-	pkg_id		INTEGER,
-	pattern		TEXT NOT NULL,
-	pkgbase		TEXT
-);
-CREATE INDEX idx_remote_supersedes_pkg_id ON remote_supersedes (
-	pkg_id		ASC
-);
-CREATE INDEX idx_remote_supersedes_pattern ON remote_supersedes (
-	pattern		ASC
-);
 
 /*
  * +REQUIRED_BY
@@ -177,15 +109,6 @@ CREATE INDEX idx_local_required_by_required_by ON local_required_by (
 	required_by	ASC
 );
 
-CREATE INDEX [idx_remote_pkg_category] ON [REMOTE_PKG] (
-	[CATEGORIES] ASC
-);
-CREATE INDEX [idx_remote_pkg_comment] ON [REMOTE_PKG] (
-	[COMMENT] ASC
-);
-CREATE INDEX [idx_remote_pkg_name] ON [REMOTE_PKG] (
-	[PKGNAME] ASC
-);
 CREATE INDEX [idx_local_pkg_category] ON [LOCAL_PKG] (
 	[CATEGORIES] ASC
 );
@@ -31,16 +31,57 @@
 #include "pkgin.h"
 
 static sqlite3	*pdb;
-static int              repo_counter = 0;
+static int		remote_lock = -1;
+static int		db_corrupt = 0;
 static uint64_t		savepoint_counter = 0;
 
+/*
+ * Secondary indexes dropped for a bulk load, to be recreated at the end, and
+ * the page cache size in KiB (negative) to use meanwhile.
+ */
+#define BULK_CACHE_SIZE	"-65536"
+
+static struct {
+	char		**name;
+	char		**sql;
+	int		num;
+	uint64_t	savepoint;
+	char		cache_size[32];
+} bulk;
+
+/*
+ * Migrations for each version of the schema, see pkgindb_migrate().
+ */
+static const char *const pkgindb_migrations[PKGIN_DB_VERSION] = {
+	MIGRATE_DB_1,
+	MIGRATE_DB_2,
+	MIGRATE_DB_3,
+};
+
+static const char *const remotedb_migrations[REMOTE_DB_VERSION] = {
+	MIGRATE_REMOTEDB_1,
+	MIGRATE_REMOTEDB_2,
+	MIGRATE_REMOTEDB_3,
+};
+
 static const char *pragmaopts[] = {
-	"locking_mode = EXCLUSIVE",
+	"main.locking_mode = EXCLUSIVE",
 	"empty_result_callbacks = 1",
 	"synchronous = EXTRA",
 	NULL
 };
 
+/*
+ * The remote catalog is kept in a separate database attached as "remote", and
+ * is not locked exclusively so that it can be read while a new one is built.
+ * Everything in it can be fetched again from the repositories, so it does not
+ * pay for a sync on every commit, and is recreated if it is found damaged.
+ */
+static const char *remote_pragmaopts[] = {
+	"synchronous = OFF",
+	NULL
+};
+
 /*
  * Used to keep track of the current query so that it can be used in the
  * error log callback for diagnostics.
@@ -54,7 +95,11 @@ static const char *curquery = NULL;
 
 char *pkgin_dbdir;
 char *pkgin_sqldb;
+char *pkgin_remotedir;
+char *pkgin_remotedb;
+char *pkgin_remotedb_new;
 char *pkgin_cache;
+char *pkgin_sumdir;
 char *pkgin_errlog;
 char *pkgin_sqllog;
 
@@ -68,8 +113,21 @@ setup_pkgin_dbdir(void)
 	else
 		pkgin_dbdir = xasprintf("%s", PKGIN_DBDIR);
 
+	/*
+	 * The remote catalog and the pkg_summary files it was imported from
+	 * do not depend on anything installed, so may be kept elsewhere and
+	 * shared by several roots, see pkgindb_remote_begin().
+	 */
+	if ((p = getenv("PKGIN_REMOTE_DBDIR")) != NULL)
+		pkgin_remotedir = xasprintf("%s", p);
+	else
+		pkgin_remotedir = xasprintf("%s", pkgin_dbdir);
+
 	pkgin_sqldb = xasprintf("%s/pkgin.db", pkgin_dbdir);
+	pkgin_remotedb = xasprintf("%s/remote.db", pkgin_remotedir);
+	pkgin_remotedb_new = xasprintf("%s/remote.db.new", pkgin_remotedir);
 	pkgin_cache = xasprintf("%s/cache", pkgin_dbdir);
+	pkgin_sumdir = xasprintf("%s/summary", pkgin_remotedir);
 	pkgin_errlog = xasprintf("%s/pkg_install-err.log", pkgin_dbdir);
 	pkgin_sqllog = xasprintf("%s/sql.log", pkgin_dbdir);
 
@@ -78,6 +136,11 @@ setup_pkgin_dbdir(void)
 			err(1, "Failed to create %s", pkgin_dbdir);
 	}
 
+	if (access(pkgin_remotedir, F_OK) != 0) {
+		if (mkdir(pkgin_remotedir, 0755) < 0)
+			err(1, "Failed to create %s", pkgin_remotedir);
+	}
+
 	if (access(pkgin_cache, F_OK) != 0) {
 		if (mkdir(pkgin_cache, 0755) < 0)
 			err(1, "Failed to create %s", pkgin_cache);
@@ -148,6 +211,10 @@ pkgindb_sqlerr_cb(void *arg, int errcode, const char *errmsg)
 	char curtime[64];
 	char **query = (char **)arg;
 
+	if ((errcode & 0xff) == SQLITE_CORRUPT ||
+	    (errcode & 0xff) == SQLITE_NOTADB)
+		db_corrupt = 1;
+
 	now = time(NULL);
 	tm = *(localtime(&now));
 	strftime(curtime, sizeof(curtime), "%Y-%m-%d %H:%M:%S %Z", &tm);
@@ -231,15 +298,486 @@ pkgindb_savepoint_release(uint64_t savepoint)
 	}
 }
 
+static int
+pdb_save_index(void *param, int argc, char **argv, char **colname)
+{
+	if (argv == NULL)
+		return PDB_OK;
+
+	bulk.name = xrealloc(bulk.name, (bulk.num + 1) * sizeof(char *));
+	bulk.sql = xrealloc(bulk.sql, (bulk.num + 1) * sizeof(char *));
+	bulk.name[bulk.num] = xstrdup(argv[0]);
+	bulk.sql[bulk.num] = xstrdup(argv[1]);
+	bulk.num++;
+
+	return PDB_OK;
+}
+
+/*
+ * Prepare to import entire catalogs into the remote tables.  Updating every
+ * secondary index row by row costs more than the inserts themselves, so they
+ * are dropped until pkgindb_bulk_end() recreates them in a single pass.  All
+ * of this happens in one transaction, so an import that does not complete
+ * leaves the indexes as they were, and the page cache is enlarged for the
+ * duration so that it does not spill to the database file mid-transaction.
+ *
+ * Lookups by PKG_ID are unindexed until then, so the catalog is emptied
+ * first (see empty_remotedb()) and no packages are deleted in the meantime.
+ */
+void
+pkgindb_bulk_begin(void)
+{
+	int i;
+
+	bulk.cache_size[0] = '\0';
+	pkgindb_doquery("PRAGMA remote.cache_size;", pdb_get_value,
+	    bulk.cache_size);
+	pkgindb_doquery("PRAGMA remote.cache_size = " BULK_CACHE_SIZE ";",
+	    NULL, NULL);
+
+	bulk.savepoint = pkgindb_savepoint();
+
+	pkgindb_doquery(SELECT_REMOTE_INDEXES, pdb_save_index, NULL);
+
+	for (i = 0; i < bulk.num; i++) {
+		if (pkgindb_dovaquery("DROP INDEX remote.\"%w\";",
+		    bulk.name[i]) != PDB_OK)
+			errx(EXIT_FAILURE, "cannot drop index %s: %s",
+			    bulk.name[i], sqlite3_errmsg(pdb));
+	}
+}
+
+/*
+ * Recreate the indexes dropped by pkgindb_bulk_begin() and commit.  The saved
+ * statements do not name a schema, which would mean "main".
+ */
+void
+pkgindb_bulk_end(void)
+{
+	const char *create = "CREATE INDEX ";
+	int i;
+
+	for (i = 0; i < bulk.num; i++) {
+		if (strncmp(bulk.sql[i], create, strlen(create)) != 0 ||
+		    pkgindb_dovaquery("CREATE INDEX remote.%s",
+		    bulk.sql[i] + strlen(create)) != PDB_OK)
+			errx(EXIT_FAILURE, "cannot create index %s: %s",
+			    bulk.name[i], sqlite3_errmsg(pdb));
+		free(bulk.name[i]);
+		free(bulk.sql[i]);
+	}
+
+	XFREE(bulk.name);
+	XFREE(bulk.sql);
+	bulk.num = 0;
+
+	pkgindb_savepoint_release(bulk.savepoint);
+
+	if (bulk.cache_size[0] != '\0')
+		pkgindb_dovaquery("PRAGMA remote.cache_size = %s;",
+		    bulk.cache_size);
+}
+
+/*
+ * Create an empty remote catalog.  This uses its own connection, as the
+ * statements in remote.sql do not name a schema.  Several roots sharing the
+ * catalog may try to create it at the same time, so it is created under a
+ * temporary name and linked into place, and the first one there wins.
+ */
+static void
+create_remotedb(const char *path)
+{
+	sqlite3 *db;
+	char buf[64], *tmp;
+
+	tmp = xasprintf("%s.%ld", path, (long)getpid());
+	(void) unlink(tmp);
+
+	if (sqlite3_open_v2(tmp, &db,
+	    SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK)
+		errx(EXIT_FAILURE, "cannot create %s: %s", path,
+		    sqlite3_errmsg(db));
+
+	curquery = CREATE_REMOTEDB;
+	if (sqlite3_exec(db, CREATE_REMOTEDB, NULL, NULL, NULL) != SQLITE_OK)
+		errx(EXIT_FAILURE, "cannot create %s: %s", path,
+		    sqlite3_errmsg(db));
+	curquery = NULL;
+
+	snprintf(buf, sizeof(buf), "PRAGMA user_version = %d;",
+	    REMOTE_DB_VERSION);
+	(void) sqlite3_exec(db, buf, NULL, NULL, NULL);
+
+	sqlite3_close(db);
+
+	if (link(tmp, path) < 0 && errno != EEXIST)
+		err(EXIT_FAILURE, "cannot create %s", path);
+	(void) unlink(tmp);
+	free(tmp);
+}
+
+/*
+ * Bring a database up to the latest schema version by applying each of the
+ * migrations after its user_version, all in a single transaction.  Returns
+ * the number applied, or -1 if any fails or the database is from a newer
+ * version, in which case it is left untouched and must be recreated.
+ */
+static int
+pkgindb_migrate(const char *schema, const char *const *migrations, int latest)
+{
+	char	buf[BUFSIZ];
+	int	version, from;
+
+	buf[0] = '\0';
+	sqlite3_snprintf(sizeof(buf), buf, "PRAGMA %w.user_version;", schema);
+	if (pkgindb_doquery(buf, pdb_get_value, buf) != PDB_OK)
+		return -1;
+
+	if ((from = atoi(buf)) == latest)
+		return 0;
+	if (from > latest)
+		return -1;
+
+	if (pkgindb_doquery("BEGIN;", NULL, NULL) != PDB_OK)
+		return -1;
+
+	for (version = from; version < latest; version++) {
+		if (pkgindb_doquery(migrations[version], NULL,
+		    NULL) != PDB_OK) {
+			pkgindb_doquery("ROLLBACK;", NULL, NULL);
+			return -1;
+		}
+	}
+
+	if (pkgindb_dovaquery("PRAGMA %w.user_version = %d;", schema,
+	    latest) != PDB_OK ||
+	    pkgindb_doquery("COMMIT;", NULL, NULL) != PDB_OK) {
+		pkgindb_doquery("ROLLBACK;", NULL, NULL);
+		return -1;
+	}
+
+	return latest - from;
+}
+
+static int
+attach_remotedb(const char *path)
+{
+	int i;
+
+	if (pkgindb_dovaquery("ATTACH %Q AS remote;", path) != PDB_OK)
+		return PDB_ERR;
+
+	for (i = 0; remote_pragmaopts[i] != NULL; i++)
+		pkgindb_dovaquery("PRAGMA remote.%s;", remote_pragmaopts[i]);
+
+	return PDB_OK;
+}
+
+static void
+detach_remotedb(void)
+{
+	if (sqlite3_db_filename(pdb, "remote") == NULL)
+		return;
+
+	if (pkgindb_doquery("DETACH remote;", NULL, NULL) != PDB_OK)
+		errx(EXIT_FAILURE, "cannot close remote database: %s",
+		    sqlite3_errmsg(pdb));
+}
+
+static void
+remove_remotedb(void)
+{
+	char *journal;
+
+	if (unlink(pkgin_remotedb) < 0 && errno != ENOENT)
+		err(EXIT_FAILURE, "cannot recreate %s", pkgin_remotedb);
+
+	journal = xasprintf("%s-journal", pkgin_remotedb);
+	(void) unlink(journal);
+	free(journal);
+}
+
+/*
+ * Return the schema version of the attached remote catalog, or -1 if it
+ * cannot be read.
+ */
+static int
+remotedb_version(void)
+{
+	char buf[BUFSIZ];
+
+	buf[0] = '\0';
+	if (pkgindb_doquery("PRAGMA remote.user_version;", pdb_get_value,
+	    buf) != PDB_OK)
+		return -1;
+
+	return atoi(buf);
+}
+
+/*
+ * Check a remote catalog on its own connection, so that it does not matter
+ * which one is attached.  Returns 1 if it is damaged, but not if it simply
+ * cannot be opened or checked, for example by a user who cannot read it.
+ */
+static int
+remotedb_damaged(const char *path)
+{
+	sqlite3		*db;
+	sqlite3_stmt	*stmt;
+	int		rv, damaged = 0;
+
+	if ((rv = sqlite3_open_v2(path, &db, SQLITE_OPEN_READONLY, NULL))
+	    == SQLITE_OK && (rv = sqlite3_prepare_v2(db,
+	    "PRAGMA quick_check(1);", -1, &stmt, NULL)) == SQLITE_OK) {
+		if ((rv = sqlite3_step(stmt)) == SQLITE_ROW) {
+			damaged = strcmp((const char *)
+			    sqlite3_column_text(stmt, 0), "ok") != 0;
+			rv = SQLITE_OK;
+		}
+		sqlite3_finalize(stmt);
+	}
+	sqlite3_close(db);
+
+	if ((rv & 0xff) == SQLITE_CORRUPT || (rv & 0xff) == SQLITE_NOTADB)
+		damaged = 1;
+
+	return damaged;
+}
+
+/*
+ * Take the lock on remote.db.lock, waiting for any other holder, possibly
+ * from another root sharing the catalog, to finish.  Other pkgin processes
+ * keep reading the current catalog in the meantime, so the exclusive lock on
+ * pkgin.db is released for the duration.  Anything left behind in
+ * remote.db.new by an earlier update that did not finish is discarded.
+ */
+static void
+lock_remotedb(void)
+{
+	struct flock	fl;
+	char		*path;
+
+	path = xasprintf("%s.lock", pkgin_remotedb);
+	if ((remote_lock = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+		err(EXIT_FAILURE, "cannot open %s", path);
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	if (fcntl(remote_lock, F_SETLK, &fl) < 0) {
+		if (errno != EAGAIN && errno != EACCES)
+			err(EXIT_FAILURE, "cannot lock %s", path);
+		warnx("waiting for another update to finish");
+		while (fcntl(remote_lock, F_SETLKW, &fl) < 0)
+			if (errno != EINTR)
+				err(EXIT_FAILURE, "cannot lock %s", path);
+	}
+	free(path);
+
+	path = xasprintf("%s-journal", pkgin_remotedb_new);
+	(void) unlink(path);
+	(void) unlink(pkgin_remotedb_new);
+	free(path);
+
+	pkgindb_doquery("PRAGMA main.locking_mode = NORMAL;", NULL, NULL);
+	pkgindb_doquery("SELECT COUNT(*) FROM main.sqlite_master;", NULL, NULL);
+}
+
+/*
+ * Take the update lock, which is held from before the current catalog is
+ * looked at until its replacement is in place, see pkgindb_remote_begin().
+ * If another update holds it, wait for it to finish and then look at the
+ * catalog it left, so that anything it already fetched is found to be
+ * up-to-date.
+ */
+void
+pkgindb_remote_lock(void)
+{
+	detach_remotedb();
+	lock_remotedb();
+	if (attach_remotedb(pkgin_remotedb) != PDB_OK)
+		errx(EXIT_FAILURE, "cannot open %s: %s", pkgin_remotedb,
+		    sqlite3_errmsg(pdb));
+}
+
+/*
+ * Release the update lock without replacing the catalog.
+ */
+void
+pkgindb_remote_unlock(void)
+{
+	close(remote_lock);
+	remote_lock = -1;
+
+	pkgindb_doquery("PRAGMA main.locking_mode = EXCLUSIVE;", NULL, NULL);
+}
+
+/*
+ * Start building a new remote catalog, which is a copy of the current one
+ * in remote.db.new that takes its place as "remote" until
+ * pkgindb_remote_commit() renames it over remote.db.  Nothing reads it before
+ * then, so its journal is only kept in memory for savepoint rollbacks, and it
+ * is synced once before being renamed.
+ *
+ * The current catalog is never written to, and only one update may build a
+ * new one at a time.  This is enforced by pkgindb_remote_lock() with a lock
+ * on remote.db.lock rather than on remote.db, as any SQLite lock there would
+ * also stop other processes from reading it.
+ */
+void
+pkgindb_remote_begin(void)
+{
+	sqlite3		*src, *dst;
+	sqlite3_backup	*backup;
+
+	detach_remotedb();
+
+	if (sqlite3_open_v2(pkgin_remotedb, &src, SQLITE_OPEN_READONLY,
+	    NULL) != SQLITE_OK)
+		errx(EXIT_FAILURE, "cannot open %s: %s", pkgin_remotedb,
+		    sqlite3_errmsg(src));
+	if (sqlite3_open_v2(pkgin_remotedb_new, &dst,
+	    SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK)
+		errx(EXIT_FAILURE, "cannot create %s: %s", pkgin_remotedb_new,
+		    sqlite3_errmsg(dst));
+	(void) sqlite3_exec(dst, "PRAGMA synchronous = OFF;", NULL, NULL, NULL);
+	if ((backup = sqlite3_backup_init(dst, "main", src, "main")) == NULL)
+		errx(EXIT_FAILURE, "cannot copy %s: %s", pkgin_remotedb,
+		    sqlite3_errmsg(dst));
+	(void) sqlite3_backup_step(backup, -1);
+	if (sqlite3_backup_finish(backup) != SQLITE_OK)
+		errx(EXIT_FAILURE, "cannot copy %s: %s", pkgin_remotedb,
+		    sqlite3_errmsg(dst));
+	sqlite3_close(src);
+	sqlite3_close(dst);
+
+	if (attach_remotedb(pkgin_remotedb_new) != PDB_OK)
+		errx(EXIT_FAILURE, "cannot open %s: %s", pkgin_remotedb_new,
+		    sqlite3_errmsg(pdb));
+	pkgindb_doquery("PRAGMA remote.journal_mode = MEMORY;", NULL, NULL);
+}
+
+/*
+ * Replace remote.db with the newly built catalog.  Processes that already have
+ * the old one open keep reading it until they exit.
+ */
+void
+pkgindb_remote_commit(void)
+{
+	int fd;
+
+	detach_remotedb();
+
+	if ((fd = open(pkgin_remotedb_new, O_RDWR)) < 0 || fsync(fd) < 0)
+		err(EXIT_FAILURE, "cannot sync %s", pkgin_remotedb_new);
+	close(fd);
+
+	if (rename(pkgin_remotedb_new, pkgin_remotedb) < 0)
+		err(EXIT_FAILURE, "cannot rename %s", pkgin_remotedb_new);
+
+	if (attach_remotedb(pkgin_remotedb) != PDB_OK)
+		errx(EXIT_FAILURE, "cannot open %s: %s", pkgin_remotedb,
+		    sqlite3_errmsg(pdb));
+
+	pkgindb_remote_unlock();
+}
+
+/*
+ * Replace the remote catalog with an empty one, with the update lock held.
+ */
+static void
+reset_remotedb(void)
+{
+	detach_remotedb();
+	(void) unlink(pkgin_remotedb_new);
+	create_remotedb(pkgin_remotedb_new);
+	if (attach_remotedb(pkgin_remotedb_new) != PDB_OK)
+		errx(EXIT_FAILURE, "cannot open %s: %s", pkgin_remotedb_new,
+		    sqlite3_errmsg(pdb));
+	pkgindb_remote_commit();
+}
+
+/*
+ * Bring an older or unreadable remote catalog up to date.  Other roots may be
+ * reading it, so this is only done with the update lock held, on a copy that
+ * is then renamed over it, and only after checking again that nothing else
+ * did so while the lock was waited for.  A catalog that cannot be migrated is
+ * replaced with an empty one.  Returns 1, as some migrations leave it empty.
+ */
+static int
+upgrade_remotedb(void)
+{
+	int version = -1;
+
+	detach_remotedb();
+	lock_remotedb();
+
+	if (access(pkgin_remotedb, F_OK) == 0 &&
+	    attach_remotedb(pkgin_remotedb) == PDB_OK)
+		version = remotedb_version();
+
+	if (version > REMOTE_DB_VERSION) {
+		pkgindb_remote_unlock();
+		errx(EXIT_FAILURE, "%s is from a newer version of pkgin",
+		    pkgin_remotedb);
+	}
+
+	if (version == REMOTE_DB_VERSION) {
+		pkgindb_remote_unlock();
+		return 1;
+	}
+
+	if (version >= 0) {
+		pkgindb_remote_begin();
+		if (pkgindb_migrate("remote", remotedb_migrations,
+		    REMOTE_DB_VERSION) >= 0) {
+			pkgindb_remote_commit();
+			return 1;
+		}
+	}
+
+	reset_remotedb();
+	db_corrupt = 0;
+
+	return 1;
+}
+
+/*
+ * Open the remote catalog, creating it if necessary.  It is never changed in
+ * place, as other roots may share it, see upgrade_remotedb(), and one from a
+ * newer version of pkgin is left alone.  Returns 1 if it needs to be
+ * populated.
+ */
+static int
+open_remotedb(void)
+{
+	int version = -1, created = 0;
+
+	if (access(pkgin_remotedb, F_OK) < 0) {
+		create_remotedb(pkgin_remotedb);
+		created = 1;
+	}
+
+	if (attach_remotedb(pkgin_remotedb) == PDB_OK)
+		version = remotedb_version();
+
+	if (version == REMOTE_DB_VERSION)
+		return created;
+	if (version > REMOTE_DB_VERSION)
+		errx(EXIT_FAILURE, "%s is from a newer version of pkgin",
+		    pkgin_remotedb);
+
+	return upgrade_remotedb();
+}
+
 /*
  * Configure the pkgin database.  Returns 0 if opening an existing compatible
  * database, or 1 if the database needs to be created or recreated (in the case
- * of a schema upgrade).  Any other error is fatal.
+ * of a schema upgrade that cannot be migrated).  Any other error is fatal.
  */
 int
 pkgindb_open(void)
 {
-	int create, i, oflags;
+	int create, remote, i, oflags, tocatalog, migrated = 0;
 	char buf[128];
 
 	/*
@@ -266,20 +804,15 @@ recreate:
 
 	/*
 	 * If we're creating or recreating a new database, attempt to populate
-	 * the initial schema, otherwise perform a compatibility check.  If the
-	 * compatibility check fails then we simply remove the existing database
-	 * and recreate, there is no support for online upgrades at this time.
+	 * the initial schema.
 	 */
 	if (create) {
-		if (pkgindb_doquery(CREATE_DRYDB, NULL, NULL) != PDB_OK)
+		snprintf(buf, sizeof(buf), "PRAGMA user_version = %d;",
+		    PKGIN_DB_VERSION);
+		if (pkgindb_doquery(CREATE_DRYDB, NULL, NULL) != PDB_OK ||
+		    pkgindb_doquery(buf, NULL, NULL) != PDB_OK)
 			errx(EXIT_FAILURE, "cannot create database: %s",
 			    sqlite3_errmsg(pdb));
-	} else {
-		if (pkgindb_doquery(CHECK_DB_LATEST, NULL, NULL) != PDB_OK) {
-			if (unlink(pkgin_sqldb) < 0)
-				err(EXIT_FAILURE, "cannot recreate database");
-			goto recreate;
-		}
 	}
 
 	/* Apply PRAGMA properties */
@@ -288,12 +821,78 @@ recreate:
 		pkgindb_doquery(buf, NULL, NULL);
 	}
 
-	return create;
+	remote = open_remotedb();
+
+	/*
+	 * Upgrade an existing database in place.  From version 0 this also
+	 * moves data to the remote catalog, which like any other change to it
+	 * is made to a new copy with the update lock held.  If that is not
+	 * possible then we simply remove it and recreate.
+	 */
+	if (!create) {
+		buf[0] = '\0';
+		pkgindb_doquery("PRAGMA main.user_version;", pdb_get_value,
+		    buf);
+		if ((tocatalog = (atoi(buf) == 0))) {
+			pkgindb_remote_lock();
+			pkgindb_remote_begin();
+		}
+
+		migrated = pkgindb_migrate("main", pkgindb_migrations,
+		    PKGIN_DB_VERSION);
+
+		if (tocatalog && migrated >= 0)
+			pkgindb_remote_commit();
+		else if (tocatalog) {
+			detach_remotedb();
+			pkgindb_remote_unlock();
+		}
+
+		if (migrated < 0) {
+			sqlite3_close(pdb);
+			if (unlink(pkgin_sqldb) < 0)
+				err(EXIT_FAILURE, "cannot recreate database");
+			goto recreate;
+		}
+	}
+
+	/* Reclaim the space of anything that was moved or dropped. */
+	if (migrated > 0)
+		pkgindb_doquery("VACUUM main;", NULL, NULL);
+
+	return create || remote;
 }
 
+/*
+ * If any query reported a damaged database, check whether it was the remote
+ * catalog and if so remove it, so that it is fetched again next time rather
+ * than causing the same errors.  The error log does not say which database
+ * failed, and it may well have been pkgin.db, so the catalog is checked first
+ * without waiting for the update lock.  Another root may have replaced it in
+ * the meantime, so it is only removed if still damaged with the lock held.
+ */
 void
 pkgindb_close(void)
 {
+	if (db_corrupt) {
+		db_corrupt = 0;
+		detach_remotedb();
+		if (access(pkgin_remotedb, F_OK) == 0 &&
+		    remotedb_damaged(pkgin_remotedb)) {
+			if (remote_lock < 0)
+				lock_remotedb();
+			if (access(pkgin_remotedb, F_OK) == 0 &&
+			    remotedb_damaged(pkgin_remotedb)) {
+				remove_remotedb();
+				warnx("%s was damaged and has been removed, "
+				    "it will be recreated on the next run",
+				    pkgin_remotedb);
+			}
+			close(remote_lock);
+			remote_lock = -1;
+		}
+	}
+
 	sqlite3_close(pdb);
 }
 
@@ -348,6 +947,25 @@ pkgindb_stmt_finalize(sqlite3_stmt *stmt)
 	(void) sqlite3_finalize(stmt);
 }
 
+/*
+ * Return the PKG_ID assigned by the most recent successful INSERT.
+ */
+int64_t
+pkgindb_last_insert_id(void)
+{
+	return sqlite3_last_insert_rowid(pdb);
+}
+
+/*
+ * Return the number of rows changed by the most recent statement, for example
+ * 0 for an INSERT OR IGNORE that was ignored.
+ */
+int
+pkgindb_changes(void)
+{
+	return sqlite3_changes(pdb);
+}
+
 int
 pkg_db_mtime(struct stat *st)
 {
@@ -427,7 +1045,6 @@ repo_record(char **repos)
 	for (i = 0; repos[i] != NULL; i++) {
 		sqlite3_snprintf(BUFSIZ, query, EXISTS_REPO, repos[i]);
 		pkgindb_doquery(query, pdb_get_value, &value[0]);
-                repo_counter++;
 
 		if (value[0] == '0') {
 			/* repository does not exists */
@@ -437,30 +1054,56 @@ repo_record(char **repos)
 	}
 }
 
-time_t
-pkg_sum_mtime(char *repo)
+/*
+ * Look up what the last update recorded for a repository: the validators of
+ * its pkg_summary for the next conditional fetch, and which compression it
+ * was found with and when all of them were last tried.
+ */
+void
+pkg_sum_repo(Sumrepo *repo)
 {
-	time_t	db_mtime = 0;
-	char	str_mtime[20], query[BUFSIZ];
+	sqlite3_stmt	*stmt;
+	const char	*ext, *filter;
+	int		rc;
+
+	repo->mtime = 0;
+	repo->dbsize = -1;
+	repo->dbext = NULL;
+	repo->probed = 0;
+	repo->dbfilter = NULL;
 
-	str_mtime[0] = '\0';
+	curquery = "SELECT REPO_MTIME, REPO_SIZE, REPO_EXT, REPO_PROBED,"
+		   "       REPO_FILTER"
+		   "  FROM REPOS WHERE REPO_URL GLOB ?1 || '*';";
 
-	sqlite3_snprintf(BUFSIZ, query,
-	    "SELECT REPO_MTIME FROM REPOS WHERE REPO_URL GLOB %Q || '*';",
-	    repo);
-	pkgindb_doquery(query, pdb_get_value, str_mtime);
+	if (sqlite3_prepare_v2(pdb, curquery, -1, &stmt, NULL) != SQLITE_OK)
+		pkgindb_sqlfail();
 
-	if (str_mtime[0] != '\0')
-		db_mtime = (time_t)strtol(str_mtime, (char **)NULL, 10);
+	sqlite3_bind_text(stmt, 1, repo->url, -1, SQLITE_STATIC);
 
-	return db_mtime;
+	rc = sqlite3_step(stmt);
+
+	if (rc == SQLITE_ROW) {
+		repo->mtime = (time_t)sqlite3_column_int64(stmt, 0);
+		if (sqlite3_column_type(stmt, 1) != SQLITE_NULL)
+			repo->dbsize = (off_t)sqlite3_column_int64(stmt, 1);
+		if ((ext = (const char *)sqlite3_column_text(stmt, 2)) != NULL)
+			repo->dbext = xstrdup(ext);
+		repo->probed = (time_t)sqlite3_column_int64(stmt, 3);
+		if ((filter = (const char *)sqlite3_column_text(stmt, 4))
+		    != NULL)
+			repo->dbfilter = xstrdup(filter);
+	} else if (rc != SQLITE_DONE)
+		pkgindb_sqlfail();
+
+	sqlite3_finalize(stmt);
 }
 
 void
 pkgindb_stats(void)
 {
 	sqlite3_stmt	*stmt;
-	int		lcount, rcount;
+	int		lcount, rcount, nrepos = 0;
 	char	lsize[H_BUF], rsize[H_BUF];
 
 	curquery = "SELECT "
@@ -487,6 +1130,9 @@ pkgindb_stats(void)
 
 	sqlite3_finalize(stmt);
 
+	while (pkg_repos[nrepos] != NULL)
+		nrepos++;
+
 	printf("Local package database:\n"
 	       "\tInstalled packages: %d\n"
 	       "\tDisk space occupied: %s\n\n"
@@ -494,5 +1140,5 @@ pkgindb_stats(void)
 	       "\tNumber of repositories: %d\n"
 	       "\tPackages available: %d\n"
 	       "\tTotal size of packages: %s\n",
-	       lcount, lsize, repo_counter, rcount, rsize);
+	       lcount, lsize, nrepos, rcount, rsize);
 }
@@ -33,10 +33,38 @@
 #include <stdint.h>
 #include "pkgindb_create.h"
 
-extern const char CHECK_DB_LATEST[];
+/*
+ * Schema versions, recorded as the user_version of pkgin.db and remote.db.
+ */
+#define PKGIN_DB_VERSION	3
+#define REMOTE_DB_VERSION	3
+
+extern const char MIGRATE_DB_1[];
+extern const char MIGRATE_DB_2[];
+extern const char MIGRATE_DB_3[];
+extern const char MIGRATE_REMOTEDB_1[];
+extern const char MIGRATE_REMOTEDB_2[];
+extern const char MIGRATE_REMOTEDB_3[];
 extern const char DELETE_LOCAL[];
+extern const char DELETE_LOCAL_STALE[];
+extern const char CREATE_LOCAL_CHANGED[];
+extern const char INSERT_LOCAL_CHANGED[];
+extern const char DELETE_LOCAL_REQUIRED_BY_CHANGED[];
+extern const char SELECT_LOCAL_DEPENDS_CHANGED[];
+extern const char SELECT_LOCAL_PKGDB[];
+extern const char INSERT_LOCAL_PKGDB[];
+extern const char DELETE_LOCAL_PKGDB[];
+extern const char UPDATE_LOCAL_KEEP[];
 extern const char DELETE_REMOTE[];
 extern const char DELETE_REMOTE_PKG_REPO[];
+extern const char DELETE_REMOTE_PKG_ID[];
+extern const char DELETE_REMOTE_ALL[];
+extern const char SELECT_REMOTE_INDEXES[];
+extern const char COUNT_REMOTE_PKG[];
+extern const char SELECT_REMOTE_PKG_REPO[];
+extern const char SELECT_REMOTE_PKG_OWNER[];
+extern const char SELECT_REMOTE_DESCRIPTION[];
+extern const char SELECT_REMOTE_PKG_FILE[];
 extern const char LOCAL_DIRECT_DEPENDS[];
 extern const char REMOTE_DIRECT_DEPENDS[];
 extern const char LOCAL_REVERSE_DEPENDS[];
@@ -54,19 +82,27 @@ extern const char LOCAL_PKGS_QUERY_DESC[];
 extern const char REMOTE_PKGS_QUERY_DESC[];
 extern const char NOKEEP_LOCAL_PKGS[];
 extern const char KEEP_LOCAL_PKGS[];
+extern const char SELECT_KEEP_PKGNAMES[];
 extern const char PKG_URL[];
-extern const char DELETE_EMPTY_ROWS[];
 extern const char SELECT_REPO_URLS[];
+extern const char SELECT_REPO_FILTERS[];
 extern const char EXISTS_REPO[];
 extern const char INSERT_REPO[];
-extern const char UPDATE_REPO_MTIME[];
+extern const char UPDATE_REPO_SUM[];
+extern const char RESET_REPO_SUM[];
+extern const char UPDATE_REPO_EXT[];
+extern const char UPDATE_REPO_FILTER[];
 extern const char DELETE_REPO_URL[];
 extern const char INSERT_CONFLICTS[];
 extern const char INSERT_DEPENDS[];
 extern const char INSERT_PROVIDES[];
 extern const char INSERT_REQUIRES[];
 extern const char INSERT_SUPERSEDES[];
+extern const char INSERT_DESCRIPTION[];
 extern const char INSERT_REQUIRED_BY[];
+extern const char SAVE_REQUIRED_BY[];
+extern const char SELECT_REQUIRED_BY_CHANGED[];
+extern const char SELECT_REQUIRED_BY[];
 extern const char UNIQUE_PKG[];
 extern const char UNIQUE_EXACT_PKG[];
 extern const char EXPORT_KEEP_LIST[];
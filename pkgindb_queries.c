@@ -28,15 +28,64 @@
  */
 
 /*
- * This query checks the compatibility of the current database, and should be
- * one that either completes or fails due to an SQL error based on the most
- * recent schema change.  Returned rows are ignored, so choose a query that
- * runs quickly.
+ * Schema migrations, applied in order by pkgindb_migrate().  MIGRATE_DB_<n>
+ * takes pkgin.db from user_version n - 1 to n, and MIGRATE_REMOTEDB_<n> does
+ * the same for remote.db.  Any that fails means the database is recreated.
+ *
+ * Version 0 is any database from before versions were recorded, so these
+ * first check that it has the most recent change from then.  pkgin.db used to
+ * hold the remote catalog as well.  That has no descriptions, so as with
+ * MIGRATE_REMOTEDB_3 only the repositories move to the newly created
+ * remote.db, with their modification times cleared so that the next update
+ * imports every summary again.
+ */
+const char MIGRATE_DB_1[] =
+	"SELECT pkgbase FROM main.local_conflicts LIMIT 1;"
+	"INSERT INTO remote.REPOS (REPO_URL, REPO_MTIME, REPO_SIZE, REPO_PROBED)"
+	"  SELECT REPO_URL, 0, NULL, 0 FROM main.REPOS;"
+	"DROP TABLE main.REPOS;"
+	"DROP TABLE main.REMOTE_PKG;"
+	"DROP TABLE main.remote_conflicts;"
+	"DROP TABLE main.remote_depends;"
+	"DROP TABLE main.remote_provides;"
+	"DROP TABLE main.remote_requires;"
+	"DROP TABLE main.remote_supersedes;";
+
+/*
+ * Without any recorded local_pkgdb entries every installed package is read
+ * again, the PKGDB times are cleared so that this happens on the next run.
  */
-const char CHECK_DB_LATEST[] =
-	"SELECT pkgbase "
-	"  FROM local_conflicts "
-	" LIMIT 1;";
+const char MIGRATE_DB_2[] =
+	"CREATE TABLE main.local_pkgdb ("
+	"  fullpkgname TEXT PRIMARY KEY, mtime INTEGER, ntime INTEGER);"
+	"DELETE FROM main.PKGDB;";
+
+const char MIGRATE_DB_3[] =
+	"ALTER TABLE main.local_pkgdb ADD COLUMN info_mtime INTEGER;"
+	"ALTER TABLE main.local_pkgdb ADD COLUMN info_ntime INTEGER;"
+	"ALTER TABLE main.local_pkgdb ADD COLUMN automatic INTEGER;"
+	"DELETE FROM main.PKGDB;";
+
+const char MIGRATE_REMOTEDB_1[] =
+	"SELECT REPO_PROBED FROM remote.REPOS LIMIT 1;";
+
+const char MIGRATE_REMOTEDB_2[] =
+	"ALTER TABLE remote.REPOS ADD COLUMN REPO_FILTER TEXT NULL;";
+
+/*
+ * Descriptions are only stored on import, so the catalog is emptied for the
+ * repositories to be imported again in full.
+ */
+const char MIGRATE_REMOTEDB_3[] =
+	"CREATE TABLE remote.remote_description ("
+	"  pkg_id INTEGER PRIMARY KEY, length INTEGER, description BLOB);"
+	"DELETE FROM remote.REMOTE_PKG;"
+	"DELETE FROM remote.remote_conflicts;"
+	"DELETE FROM remote.remote_depends;"
+	"DELETE FROM remote.remote_provides;"
+	"DELETE FROM remote.remote_requires;"
+	"DELETE FROM remote.remote_supersedes;"
+	"UPDATE remote.REPOS SET REPO_MTIME = 0, REPO_SIZE = NULL;";
 
 const char DELETE_LOCAL[] =
 	"DELETE FROM LOCAL_PKG;"
@@ -44,7 +93,88 @@ const char DELETE_LOCAL[] =
 	"DELETE FROM LOCAL_DEPENDS;"
 	"DELETE FROM LOCAL_PROVIDES;"
 	"DELETE FROM LOCAL_REQUIRES;"
-	"DELETE FROM LOCAL_REQUIRED_BY;";
+	"DELETE FROM LOCAL_REQUIRED_BY;"
+	"DELETE FROM local_pkgdb;";
+
+/*
+ * Remove the packages that are no longer recorded in local_pkgdb, because
+ * they were removed from the pkgdb or have changed and are to be read again.
+ */
+const char DELETE_LOCAL_STALE[] =
+	"DELETE FROM LOCAL_PKG WHERE FULLPKGNAME NOT IN "
+	"    (SELECT fullpkgname FROM local_pkgdb);"
+	"DELETE FROM LOCAL_CONFLICTS WHERE pkg_id NOT IN "
+	"    (SELECT PKG_ID FROM LOCAL_PKG);"
+	"DELETE FROM LOCAL_DEPENDS WHERE pkg_id NOT IN "
+	"    (SELECT PKG_ID FROM LOCAL_PKG);"
+	"DELETE FROM LOCAL_PROVIDES WHERE pkg_id NOT IN "
+	"    (SELECT PKG_ID FROM LOCAL_PKG);"
+	"DELETE FROM LOCAL_REQUIRES WHERE pkg_id NOT IN "
+	"    (SELECT PKG_ID FROM LOCAL_PKG);";
+
+/*
+ * Packages added to or removed from LOCAL_PKG during a sync are recorded in
+ * local_changed, before the removal and after the addition, as those are the
+ * only ones without a matching local_pkgdb row.
+ */
+const char CREATE_LOCAL_CHANGED[] =
+	"CREATE TEMP TABLE IF NOT EXISTS local_changed "
+	"  (pkgbase TEXT, fullpkgname TEXT);"
+	"DELETE FROM local_changed;";
+
+const char INSERT_LOCAL_CHANGED[] =
+	"INSERT INTO local_changed "
+	"  SELECT PKGNAME, FULLPKGNAME FROM LOCAL_PKG "
+	"   WHERE FULLPKGNAME NOT IN (SELECT fullpkgname FROM local_pkgdb);";
+
+/*
+ * The LOCAL_REQUIRED_BY entries that may have changed are those of changed
+ * packages, and those of packages with a dependency that a changed package
+ * could satisfy, which includes any dependency without a PKGBASE.
+ */
+const char DELETE_LOCAL_REQUIRED_BY_CHANGED[] =
+	"DELETE FROM LOCAL_REQUIRED_BY "
+	" WHERE required_by IN (SELECT fullpkgname FROM local_changed) "
+	"    OR required_by IN "
+	"       (SELECT FULLPKGNAME FROM LOCAL_PKG WHERE PKG_ID IN "
+	"           (SELECT pkg_id FROM local_depends "
+	"             WHERE pkgbase IS NULL "
+	"                OR pkgbase IN (SELECT pkgbase FROM local_changed)));";
+
+const char SELECT_LOCAL_DEPENDS_CHANGED[] =
+	"SELECT LOCAL_PKG.PKG_ID, FULLPKGNAME, pattern, pkgbase "
+	"  FROM local_depends, LOCAL_PKG "
+	" WHERE local_depends.pkg_id = LOCAL_PKG.PKG_ID "
+	"   AND (FULLPKGNAME IN (SELECT fullpkgname FROM local_changed) "
+	"        OR LOCAL_PKG.PKG_ID IN "
+	"           (SELECT pkg_id FROM local_depends "
+	"             WHERE pkgbase IS NULL "
+	"                OR pkgbase IN (SELECT pkgbase FROM local_changed))) "
+	" ORDER BY LOCAL_PKG.PKG_ID;";
+
+const char SELECT_LOCAL_PKGDB[] =
+	"SELECT fullpkgname, mtime, ntime, info_mtime, info_ntime "
+	"  FROM local_pkgdb;";
+
+const char INSERT_LOCAL_PKGDB[] =
+	"INSERT OR REPLACE INTO local_pkgdb "
+	"  (fullpkgname, mtime, ntime, info_mtime, info_ntime, automatic) "
+	"VALUES (%Q, %lld, %lld, %lld, %lld, %d);";
+
+/*
+ * Packages are kept unless they were installed automatically.  Only those
+ * that are not already set accordingly are updated.
+ */
+const char UPDATE_LOCAL_KEEP[] =
+	"UPDATE LOCAL_PKG SET PKG_KEEP = "
+	"    (SELECT CASE WHEN automatic THEN NULL ELSE 1 END "
+	"       FROM local_pkgdb WHERE fullpkgname = LOCAL_PKG.FULLPKGNAME) "
+	" WHERE PKG_KEEP IS NOT "
+	"    (SELECT CASE WHEN automatic THEN NULL ELSE 1 END "
+	"       FROM local_pkgdb WHERE fullpkgname = LOCAL_PKG.FULLPKGNAME);";
+
+const char DELETE_LOCAL_PKGDB[] =
+	"DELETE FROM local_pkgdb WHERE fullpkgname = %Q;";
 
 const char DELETE_REMOTE[] =
 	"DELETE FROM %s "
@@ -57,6 +187,38 @@ const char DELETE_REMOTE[] =
 const char DELETE_REMOTE_PKG_REPO[] =
 	"DELETE FROM REMOTE_PKG WHERE REPOSITORY = %Q;";
 
+const char DELETE_REMOTE_PKG_ID[] =
+	"DELETE FROM %s WHERE PKG_ID = ?;";
+
+const char DELETE_REMOTE_ALL[] =
+	"DELETE FROM %s;";
+
+/*
+ * Secondary indexes on the remote tables, those created implicitly for UNIQUE
+ * constraints have no SQL and are kept.
+ */
+const char SELECT_REMOTE_INDEXES[] =
+	"SELECT name, sql FROM remote.sqlite_master "
+	" WHERE type = 'index' AND sql IS NOT NULL;";
+
+const char COUNT_REMOTE_PKG[] =
+	"SELECT COUNT(*) FROM REMOTE_PKG;";
+
+const char SELECT_REMOTE_PKG_REPO[] =
+	"SELECT PKG_ID, FULLPKGNAME, BUILD_DATE FROM REMOTE_PKG "
+	" WHERE REPOSITORY = %Q;";
+
+const char SELECT_REMOTE_PKG_OWNER[] =
+	"SELECT PKG_ID, REPOSITORY FROM REMOTE_PKG WHERE FULLPKGNAME = ?;";
+
+const char SELECT_REMOTE_DESCRIPTION[] =
+	"SELECT REPOSITORY, length, description FROM REMOTE_PKG"
+	" LEFT JOIN remote_description USING (pkg_id)"
+	" WHERE FULLPKGNAME = ?;";
+
+const char SELECT_REMOTE_PKG_FILE[] =
+	"SELECT REPOSITORY, FILE_SIZE FROM REMOTE_PKG WHERE FULLPKGNAME = ?;";
+
 const char LOCAL_DIRECT_DEPENDS[] =
 	"SELECT pattern, pkgbase "
 	"  FROM local_depends, local_pkg "
@@ -147,6 +309,10 @@ const char NOKEEP_LOCAL_PKGS[] =
 	" WHERE pkg_keep IS NULL "
 	" ORDER BY fullpkgname DESC;";
 
+const char SELECT_KEEP_PKGNAMES[] =
+	"SELECT pkgname FROM local_pkg WHERE pkg_keep IS NOT NULL "
+	"ORDER BY pkgname;";
+
 const char KEEP_LOCAL_PKGS[] =
 	"SELECT fullpkgname,pkgname,pkgpath,comment "
 	"  FROM local_pkg "
@@ -156,20 +322,32 @@ const char KEEP_LOCAL_PKGS[] =
 const char PKG_URL[] =
 	"SELECT REPOSITORY FROM REMOTE_PKG WHERE FULLPKGNAME = %Q;";
 
-const char DELETE_EMPTY_ROWS[] =
-	"DELETE FROM REMOTE_PKG WHERE PKGNAME IS NULL;";
-
 const char SELECT_REPO_URLS[] =
 	"SELECT REPO_URL FROM REPOS;";
 
+const char SELECT_REPO_FILTERS[] =
+	"SELECT REPO_URL, REPO_FILTER FROM REPOS;";
+
 const char EXISTS_REPO[] =
 	"SELECT COUNT(*) FROM REPOS WHERE REPO_URL = %Q;";
 
 const char INSERT_REPO[] =
-	"INSERT INTO REPOS (REPO_URL, REPO_MTIME) VALUES (%Q, 0);";
+	"INSERT INTO REPOS (REPO_URL, REPO_MTIME, REPO_SIZE, REPO_PROBED) "
+	"VALUES (%Q, 0, -1, 0);";
+
+const char UPDATE_REPO_SUM[] =
+	"UPDATE REPOS SET REPO_MTIME = %lld, REPO_SIZE = %lld "
+	"WHERE REPO_URL = %Q;";
+
+const char RESET_REPO_SUM[] =
+	"UPDATE REPOS SET REPO_MTIME = 0, REPO_SIZE = NULL WHERE REPO_URL = %Q;";
 
-const char UPDATE_REPO_MTIME[] =
-	"UPDATE REPOS SET REPO_MTIME = %lld WHERE REPO_URL = %Q;";
+const char UPDATE_REPO_EXT[] =
+	"UPDATE REPOS SET REPO_EXT = %Q, REPO_PROBED = %lld "
+	"WHERE REPO_URL = %Q;";
+
+const char UPDATE_REPO_FILTER[] =
+	"UPDATE REPOS SET REPO_FILTER = %Q WHERE REPO_URL = %Q;";
 
 const char DELETE_REPO_URL[] =
 	"DELETE FROM REPOS WHERE REPO_URL = %Q;";
@@ -189,8 +367,37 @@ const char INSERT_REQUIRES[] =
 const char INSERT_SUPERSEDES[] =
 	"INSERT INTO %s (pkg_id, pattern, pkgbase) VALUES (?, ?, ?);";
 
+const char INSERT_DESCRIPTION[] =
+	"INSERT INTO %s (pkg_id, length, description) VALUES (?, ?, ?);";
+
 const char INSERT_REQUIRED_BY[] =
-	"INSERT INTO LOCAL_REQUIRED_BY (PKGNAME, REQUIRED_BY) VALUES (%Q, %Q);";
+	"INSERT INTO LOCAL_REQUIRED_BY (PKGNAME, REQUIRED_BY) VALUES (?, ?);";
+
+/*
+ * LOCAL_REQUIRED_BY is saved before packages are installed or removed, and
+ * the installed packages whose entries differ afterwards are those whose
+ * +REQUIRED_BY is to be written.
+ */
+const char SAVE_REQUIRED_BY[] =
+	"DROP TABLE IF EXISTS temp.required_by_saved;"
+	"CREATE TEMP TABLE required_by_saved AS "
+	"  SELECT pkgname, required_by FROM LOCAL_REQUIRED_BY;";
+
+const char SELECT_REQUIRED_BY_CHANGED[] =
+	"SELECT DISTINCT pkgname FROM ("
+	"  SELECT * FROM (SELECT pkgname, required_by FROM LOCAL_REQUIRED_BY "
+	"                 EXCEPT "
+	"                 SELECT pkgname, required_by FROM required_by_saved) "
+	"  UNION ALL "
+	"  SELECT * FROM (SELECT pkgname, required_by FROM required_by_saved "
+	"                 EXCEPT "
+	"                 SELECT pkgname, required_by FROM LOCAL_REQUIRED_BY)) "
+	" WHERE pkgname IN (SELECT FULLPKGNAME FROM LOCAL_PKG) "
+	" ORDER BY pkgname;";
+
+const char SELECT_REQUIRED_BY[] =
+	"SELECT required_by FROM LOCAL_REQUIRED_BY WHERE pkgname = ? "
+	" ORDER BY required_by;";
 
 const char UNIQUE_PKG[] =
 	"SELECT FULLPKGNAME, PKGVERS FROM %s WHERE PKGNAME = %Q;";
@@ -0,0 +1,121 @@
+CREATE TABLE [REPOS] (
+	"REPO_URL" TEXT UNIQUE,
+	"REPO_MTIME" INTEGER,
+	"REPO_SIZE" INTEGER,
+	"REPO_EXT" TEXT NULL,
+	"REPO_PROBED" INTEGER,
+	"REPO_FILTER" TEXT NULL
+);
+
+CREATE TABLE [REMOTE_PKG] (
+	"PKG_ID" INTEGER PRIMARY KEY,
+	"FULLPKGNAME" TEXT UNIQUE,
+	"PKGNAME" TEXT,
+	"PKGVERS" TEXT,
+	"BUILD_DATE" TEXT,
+	"COMMENT" TEXT,
+	"LICENSE" TEXT NULL,
+	"PKGTOOLS_VERSION" TEXT,
+	"HOMEPAGE" TEXT NULL,
+	"OS_VERSION" TEXT,
+	"PKGPATH" TEXT,
+	"PKG_OPTIONS" TEXT NULL,
+	"CATEGORIES" TEXT,
+	"SIZE_PKG" TEXT,
+	"FILE_SIZE" TEXT,
+	"OPSYS" TEXT,
+	"REPOSITORY" TEXT
+);
+
+/*
+ * CONFLICTS
+ */
+CREATE TABLE remote_conflicts (
+	pkg_id		INTEGER,
+	pattern		TEXT NOT NULL,
+	pkgbase		TEXT
+);
+CREATE INDEX idx_remote_conflicts_pkg_id ON remote_conflicts (
+	pkg_id		ASC
+);
+CREATE INDEX idx_remote_conflicts_pattern ON remote_conflicts (
+	pattern		ASC
+);
+
+/*
+ * DEPENDS
+ */
+CREATE TABLE remote_depends (
+	pkg_id		INTEGER,
+	pattern		TEXT NOT NULL,
+	pkgbase		TEXT
+);
+CREATE INDEX idx_remote_depends_pkg_id ON remote_depends (
+	pkg_id		ASC
+);
+CREATE INDEX idx_remote_depends_pattern ON remote_depends (
+	pattern		ASC
+);
+
+/*
+ * PROVIDES
+ */
+CREATE TABLE remote_provides (
+	pkg_id		INTEGER,
+	filename	TEXT
+);
+CREATE INDEX idx_remote_provides_pkg_id ON remote_provides (
+	pkg_id		ASC
+);
+CREATE INDEX idx_remote_provides_filename ON remote_provides (
+	filename	ASC
+);
+
+/*
+ * REQUIRES
+ */
+CREATE TABLE remote_requires (
+	pkg_id		INTEGER,
+	filename	TEXT
+);
+CREATE INDEX idx_remote_requires_pkg_id ON remote_requires (
+	pkg_id		ASC
+);
+CREATE INDEX idx_remote_requires_filename ON remote_requires (
+	filename	ASC
+);
+
+/*
+ * SUPERSEDES
+ */
+CREATE TABLE remote_supersedes (
+	pkg_id		INTEGER,
+	pattern		TEXT NOT NULL,
+	pkgbase		TEXT
+);
+CREATE INDEX idx_remote_supersedes_pkg_id ON remote_supersedes (
+	pkg_id		ASC
+);
+CREATE INDEX idx_remote_supersedes_pattern ON remote_supersedes (
+	pattern		ASC
+);
+
+/*
+ * DESCRIPTION, all lines of it in a single row.  It is deflated if length,
+ * the size of the text, is set.
+ */
+CREATE TABLE remote_description (
+	pkg_id		INTEGER PRIMARY KEY,
+	length		INTEGER,
+	description	BLOB
+);
+
+CREATE INDEX [idx_remote_pkg_category] ON [REMOTE_PKG] (
+	[CATEGORIES] ASC
+);
+CREATE INDEX [idx_remote_pkg_comment] ON [REMOTE_PKG] (
+	[COMMENT] ASC
+);
+CREATE INDEX [idx_remote_pkg_name] ON [REMOTE_PKG] (
+	[PKGNAME] ASC
+);
@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2026 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Microbenchmark of splitting a decoded pkg_summary into records and lines,
+ * comparing the single memchr() pass of parse_batch() with the strstr() and
+ * strsep() passes it replaced.  Not built by default, run it with
+ *
+ *	make sumbench && ./sumbench pkg_summary
+ *
+ * on an uncompressed pkg_summary.  As in update, the text is first cut into
+ * SUMBATCH_SIZE batches that end on a package boundary, and each is split
+ * with an empty per-line callback.  The best of BENCH_RUNS runs is shown.
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SUMBATCH_SIZE	(256 * 1024)
+#define BENCH_RUNS	15
+
+static size_t	nrecs, nlines;
+
+static void
+entry(char *line, size_t len)
+{
+	nlines++;
+}
+
+/*
+ * Count the records, then split the batch on each empty line and each record
+ * on its newlines, measuring every line.  The count is one more than the
+ * number of packages, as it was when parse_batch() sized its records by it.
+ */
+static void
+split_strsep(char *text, size_t textlen)
+{
+	char	*rec, *next, *line;
+	size_t	len;
+
+	nrecs++;
+	for (rec = text; (rec = strstr(rec, "\n\n")) != NULL; rec += 2)
+		nrecs++;
+
+	for (rec = text; *rec != '\0'; rec = next) {
+		if ((next = strstr(rec, "\n\n")) != NULL) {
+			*next = '\0';
+			next += 2;
+		} else
+			next = rec + strlen(rec);
+		while ((line = strsep(&rec, "\n")) != NULL) {
+			if ((len = strlen(line)) > 0 && line[len - 1] == '\r')
+				line[--len] = '\0';
+			if (len > 0)
+				entry(line, len);
+		}
+	}
+}
+
+/*
+ * Find each newline with memchr() and end the record on an empty line.
+ */
+static void
+split_memchr(char *text, size_t textlen)
+{
+	char	*line, *nl, *end = text + textlen;
+	size_t	len;
+	int	inrec = 0;
+
+	for (line = text; line < end; line = nl + 1) {
+		if ((nl = memchr(line, '\n', (size_t)(end - line))) == NULL)
+			nl = end;
+		*nl = '\0';
+		if ((len = (size_t)(nl - line)) > 0 && line[len - 1] == '\r')
+			line[--len] = '\0';
+		if (len == 0) {
+			inrec = 0;
+			continue;
+		}
+		if (!inrec) {
+			nrecs++;
+			inrec = 1;
+		}
+		entry(line, len);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const struct {
+		const char	*name;
+		void		(*split)(char *, size_t);
+	} impls[] = {
+		{ "strstr/strsep", split_strsep },
+		{ "memchr single pass", split_memchr },
+	};
+	struct timespec	start, stop;
+	FILE		*fp;
+	char		*text, *work;
+	size_t		*off = NULL, *len = NULL, textlen, pos, end;
+	size_t		i, b, nbatch = 0;
+	double		ms, best;
+	long		size;
+	int		run;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: sumbench pkg_summary\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if ((fp = fopen(argv[1], "r")) == NULL)
+		err(EXIT_FAILURE, "%s", argv[1]);
+	if (fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < 0)
+		err(EXIT_FAILURE, "%s", argv[1]);
+	textlen = (size_t)size;
+	rewind(fp);
+	if ((text = malloc(textlen + 1)) == NULL)
+		err(EXIT_FAILURE, "malloc");
+	if (fread(text, 1, textlen, fp) != textlen)
+		err(EXIT_FAILURE, "%s", argv[1]);
+	fclose(fp);
+
+	for (pos = 0; pos < textlen; pos = end) {
+		end = pos + SUMBATCH_SIZE;
+		if (end >= textlen)
+			end = textlen;
+		else {
+			while (end > pos + 2 &&
+			    !(text[end - 1] == '\n' && text[end - 2] == '\n'))
+				end--;
+			if (end == pos + 2)
+				end = pos + SUMBATCH_SIZE;
+		}
+		off = realloc(off, (nbatch + 1) * sizeof(size_t));
+		len = realloc(len, (nbatch + 1) * sizeof(size_t));
+		if (off == NULL || len == NULL)
+			err(EXIT_FAILURE, "realloc");
+		off[nbatch] = pos;
+		len[nbatch++] = end - pos;
+	}
+
+	/* Each batch is copied out with a terminating NUL. */
+	if ((work = malloc(textlen + nbatch)) == NULL)
+		err(EXIT_FAILURE, "malloc");
+
+	for (i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+		best = -1;
+		for (run = 0; run < BENCH_RUNS; run++) {
+			for (b = 0, pos = 0; b < nbatch; b++) {
+				memcpy(work + pos, text + off[b], len[b]);
+				work[pos + len[b]] = '\0';
+				pos += len[b] + 1;
+			}
+			nrecs = nlines = 0;
+
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			for (b = 0, pos = 0; b < nbatch; b++) {
+				impls[i].split(work + pos, len[b]);
+				pos += len[b] + 1;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &stop);
+
+			ms = (stop.tv_sec - start.tv_sec) * 1e3 +
+			    (stop.tv_nsec - start.tv_nsec) / 1e6;
+			if (best < 0 || ms < best)
+				best = ms;
+		}
+		printf("%-20s %8.2f ms %6.0f MB/s  %zu batches, %zu records,"
+		    " %zu lines\n", impls[i].name, best, textlen / best / 1e3,
+		    nbatch, nrecs, nlines);
+	}
+
+	free(off);
+	free(len);
+	free(work);
+	free(text);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,130 @@
+#
+# Copyright (c) 2026 The NetBSD Foundation, Inc.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+# OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+# HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+# LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+# OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+#
+
+#
+# Generate sumkeys.h from pkgin.sql and remote.sql, a perfect hash of every
+# pkg_summary key that summary.c handles: the LOCAL_PKG and REMOTE_PKG columns,
+# and the keys that are not stored there.  Those are one for each of the
+# other remote_* tables, such as DEPENDS, and DESCRIPTION which is kept in
+# remote_description, along with MACHINE_ARCH which is checked but not stored.
+#
+# The hash only looks at the first and last characters and the length of a
+# key, and the multipliers are searched for here so that no two keys collide.
+#
+
+function addkey(name) {
+	if (name in seen)
+		return
+	seen[name] = 1
+	keys[nkeys++] = name
+}
+
+BEGIN {
+	for (i = 32; i < 127; i++)
+		ord[sprintf("%c", i)] = i
+}
+
+/^CREATE TABLE \[(LOCAL|REMOTE)_PKG\]/ {
+	incols = 1
+	next
+}
+
+incols && /^\)/ {
+	incols = 0
+}
+
+incols {
+	name = $1
+	gsub(/"/, "", name)
+	addkey(name)
+}
+
+/^CREATE TABLE remote_/ {
+	addkey(toupper(substr($3, 8)))
+}
+
+END {
+	addkey("MACHINE_ARCH")
+
+	for (size = 16; size < 2 * nkeys; size *= 2)
+		;
+
+	for (; size <= 4096; size *= 2) {
+		for (a = 1; a < size; a++) {
+			for (b = 0; b < size; b++) {
+				split("", slot)
+				for (i = 0; i < nkeys; i++) {
+					k = keys[i]
+					h = (ord[substr(k, 1, 1)] * a + \
+					    ord[substr(k, length(k), 1)] * b + \
+					    length(k)) % size
+					if (h in slot)
+						break
+					slot[h] = i
+				}
+				if (i == nkeys)
+					break
+			}
+			if (b < size)
+				break
+		}
+		if (a < size)
+			break
+	}
+
+	if (size > 4096) {
+		print "sumkeys.awk: no perfect hash found" > "/dev/stderr"
+		exit 1
+	}
+
+	print "/* Automatically generated from pkgin.sql and remote.sql, DO NOT EDIT */"
+	print ""
+	print "enum {"
+	for (i = 0; i < nkeys; i++)
+		printf("\tSUMKEY_%s,\n", keys[i])
+	print "\tSUMKEY_COUNT"
+	print "};"
+	print ""
+	printf("#define SUMKEY_HASH_SIZE\t%d\n", size)
+	print "#define SUMKEY_HASH(key, len) \\"
+	printf("\t(((unsigned char)(key)[0] * %d + ", a)
+	printf("(unsigned char)(key)[(len) - 1] * %d + \\\n", b)
+	print "\t  (len)) % SUMKEY_HASH_SIZE)"
+	print ""
+	print "static const struct sumkey {"
+	print "\tconst char\t*name;"
+	print "\tsize_t\t\tlen;"
+	print "\tint\t\tkey;"
+	print "} sumkeys[SUMKEY_HASH_SIZE] = {"
+	for (h = 0; h < size; h++) {
+		if (!(h in slot))
+			continue
+		k = keys[slot[h]]
+		printf("\t[%d] = { \"%s\", %d, SUMKEY_%s },\n", h, k,
+		    length(k), k)
+	}
+	print "};"
+}
@@ -31,8 +31,19 @@
  * Import pkg_summary to SQLite database
  */
 
+#include <sys/mman.h>
+#include <sys/time.h>
+
 #include <sqlite3.h>
 #include "pkgin.h"
+#include "sumkeys.h"
+
+#ifdef HAVE_LZMA_STREAM_DECODER_MT
+#include <lzma.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 /*
  * Table name lookup, as a convenience for tables that have identical LOCAL_
@@ -46,6 +57,7 @@ static const struct Summary {
 	const char	*provides;
 	const char	*requires;
 	const char	*supersedes;
+	const char	*description;
 	const char	*end;
 } sumsw[] = {
 	[LOCAL_SUMMARY] = {
@@ -56,6 +68,7 @@ static const struct Summary {
 		"LOCAL_PROVIDES",
 		"LOCAL_REQUIRES",
 		"LOCAL_SUPERSEDES",	/* Unused */
+		"LOCAL_DESCRIPTION",	/* Unused */
 		NULL
 	},
 	[REMOTE_SUMMARY] = {
@@ -66,30 +79,119 @@ static const struct Summary {
 		"REMOTE_PROVIDES",
 		"REMOTE_REQUIRES",
 		"REMOTE_SUPERSEDES",
+		"REMOTE_DESCRIPTION",
 		NULL
 	},
 };
 
+/*
+ * Column names of the table being imported, given by the colnames callback,
+ * along with the column used for each of the sumkeys, or -1 if the table has
+ * no such column.
+ */
 struct Columns {
+	int	type;		/* LOCAL_SUMMARY or REMOTE_SUMMARY */
 	int	num;
 	char	**name;
-	size_t	*len;
+	int	key[SUMKEY_COUNT];
 } cols;
 
-typedef struct Insertlist {
-	char	*field;
-	char	*value;
-	SLIST_ENTRY(Insertlist) next;
-} Insertlist;
+/*
+ * Multi-valued entries, each stored as a separate row in its own table.  The
+ * type is one of SUMKEY_CONFLICTS, SUMKEY_DEPENDS etc.
+ */
+typedef struct Sumval {
+	int		type;
+	const char	*value;
+} Sumval;
+
+/*
+ * A column value, not necessarily NUL terminated where it is part of a
+ * longer string such as PKGNAME within the PKGNAME= entry.
+ */
+typedef struct Sumcol {
+	const char	*value;
+	int		len;
+} Sumcol;
+
+/*
+ * A package entry parsed into a flat record.  All strings point into the
+ * batch the record belongs to, col[] holds one value (or NULL) per column,
+ * and the multi-valued entries are a range of the batch vals[].
+ */
+typedef struct Sumrec {
+	Sumcol		*col;
+	const char	*arch;		/* MACHINE_ARCH */
+	size_t		val;
+	size_t		nvals;
+	size_t		descr;		/* DESCRIPTION, offset into descrs */
+	size_t		descrlen;
+	size_t		descrsize;	/* Size before deflating, or 0 */
+	int		skip;		/* Not subscribed to */
+} Sumrec;
+
+/*
+ * A batch of complete package entries, passed from the decoder to the parser
+ * and then on to the database writer.
+ */
+typedef struct Sumbatch {
+	char		*text;		/* Entries, split in place */
+	size_t		len;
+	size_t		size;
+	char		*names;		/* FULLPKGNAMEs that had no version */
+	size_t		nameslen;
+	size_t		namessz;
+	Sumcol		*colv;		/* Storage for each Sumrec col[] */
+	Sumrec		*recs;
+	size_t		nrecs;
+	size_t		recsz;
+	Sumval		*vals;
+	size_t		nvals;
+	size_t		valsz;
+	char		*descrs;	/* Each record's DESCRIPTION, packed */
+	size_t		descrslen;
+	size_t		descrssz;
+#ifdef HAVE_ZLIB
+	z_stream	*zs;
+#endif
+} Sumbatch;
+
+/*
+ * Bounded queue of batches between pipeline stages.  The producer blocks when
+ * the queue is full, so however far the decoder gets ahead of the database
+ * writer, only a few batches are held in memory at once.
+ *
+ * The batches themselves form a ring of at most SUMQUEUE_SIZE buffers per
+ * repository: once the writer is done with a batch it goes back to the
+ * decoder on the spare queue to be filled again, so after the first few there
+ * are no allocations per batch.
+ */
+#define SUMQUEUE_SIZE	4
+
+typedef struct Sumqueue {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	Sumbatch	*item[SUMQUEUE_SIZE];
+	int		head;
+	int		count;
+	int		closed;
+} Sumqueue;
+
+/*
+ * Size of the decoded text handed over in each batch.  A batch always ends
+ * on a package boundary, so it may be larger if a single entry does not fit.
+ */
+#define SUMBATCH_SIZE	(256 * 1024)
 
-SLIST_HEAD(, Insertlist) inserthead;
+struct Sumpkghead;
 
-static struct archive	*fetch_summary(char *, time_t *);
+static void		*fetch_summary(void *);
 static void		freecols(void);
-static void		free_insertlist(void);
-static void		insert_local_summary(FILE *);
-static void		insert_remote_summary(struct archive *, char *);
+static const char	*parse_batch(Sumbatch *);
+static void		insert_local_summary(Sumbatch *);
+static int		insert_remote_summary(Sumrepo *, struct Sumpkghead *);
 static void		delete_remote_tbl(struct Summary, char *);
+static void		publish_catalog(const char *);
 int			colnames(void *, int, char **, char **);
 
 char			*env_repos, **pkg_repos;
@@ -107,821 +209,3421 @@ int			force_fetch = 0;
  * zstd and gzip are fast to decompress with low memory usage; xz and bzip2 are
  * slower and require more memory.  Define PREFER_GZIP_SUMMARY to prefer gzip
  * over xz/bzip2 on slow machines with limited memory.
+ *
+ * An uncompressed pkg_summary (the empty suffix) is only looked for in local
+ * file:// repositories, where it is parsed straight from a mapping of the file
+ * and so beats any of them.
  */
 #if defined(PREFER_GZIP_SUMMARY)
-static const char *const sumexts[] = { "zst", "gz", "bz2", "xz", NULL };
+static const char *const sumexts[] = { "", "zst", "gz", "bz2", "xz", NULL };
 #else
-static const char *const sumexts[] = { "zst", "xz", "bz2", "gz", NULL };
+static const char *const sumexts[] = { "", "zst", "xz", "bz2", "gz", NULL };
 #endif
 
+static Sumqueue *
+sumq_new(void)
+{
+	Sumqueue *q;
+
+	q = xcalloc(1, sizeof(Sumqueue));
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+
+	return q;
+}
+
+static void
+sumq_free(Sumqueue *q)
+{
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->cond);
+	free(q);
+}
+
+static void
+sumq_put(Sumqueue *q, Sumbatch *b)
+{
+	pthread_mutex_lock(&q->lock);
+	while (q->count == SUMQUEUE_SIZE)
+		pthread_cond_wait(&q->cond, &q->lock);
+	q->item[(q->head + q->count++) % SUMQUEUE_SIZE] = b;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
 /*
- * Open a remote summary and return an open libarchive handler to it.
+ * Return the next batch, or NULL once the queue is closed and empty.
  */
-static struct archive *
-fetch_summary(char *cur_repo, time_t *repo_mtime)
+static Sumbatch *
+sumq_get(Sumqueue *q)
 {
-	struct	archive *a;
-	struct	archive_entry *ae;
-	Sumfile	*sum = NULL;
-	int	i;
-	char	buf[BUFSIZ];
+	Sumbatch *b = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	while (q->count == 0 && !q->closed)
+		pthread_cond_wait(&q->cond, &q->lock);
+	if (q->count > 0) {
+		b = q->item[q->head];
+		q->head = (q->head + 1) % SUMQUEUE_SIZE;
+		q->count--;
+		pthread_cond_broadcast(&q->cond);
+	}
+	pthread_mutex_unlock(&q->lock);
 
-	for (i = 0; sumexts[i] != NULL; i++) { /* try all extensions */
-		if (!force_fetch)
-			*repo_mtime = pkg_sum_mtime(cur_repo);
-		else
-			*repo_mtime = 0; /* 0 sumtime == force reload */
+	return b;
+}
 
-		snprintf(buf, BUFSIZ, "%s/%s.%s",
-				cur_repo, PKG_SUMMARY, sumexts[i]);
+static void
+sumq_close(Sumqueue *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->closed = 1;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
 
-		if ((sum = sum_open(buf, repo_mtime)) != NULL)
-			break; /* pkg_summary found and not up-to-date */
+/*
+ * A batch with no size has its text in a mapped pkg_summary.
+ */
+static void
+free_batch(Sumbatch *b)
+{
+	if (b->size > 0)
+		free(b->text);
+#ifdef HAVE_ZLIB
+	if (b->zs != NULL) {
+		deflateEnd(b->zs);
+		free(b->zs);
+	}
+#endif
+	free(b->descrs);
+	free(b->names);
+	free(b->colv);
+	free(b->recs);
+	free(b->vals);
+	free(b);
+}
 
-		if (*repo_mtime < 0) /* pkg_summary found, but up-to-date */
-			return NULL;
+/*
+ * Return an empty batch for the decoder, allocating one if the ring is not
+ * yet full, or otherwise waiting for the writer to return one.  The writer
+ * holds on to every batch of a filtered repository, so those are always
+ * allocated.
+ */
+static Sumbatch *
+get_batch(Sumrepo *repo, int *nbatches)
+{
+	Sumbatch *b;
+
+	if (*nbatches < SUMQUEUE_SIZE || repo->filter != NULL) {
+		(*nbatches)++;
+		b = xcalloc(1, sizeof(Sumbatch));
+		b->size = SUMBATCH_SIZE;
+		b->text = xmalloc(b->size + 1);
+		return b;
 	}
 
-	if (sum == NULL)
-		errx(EXIT_FAILURE, MSG_COULDNT_FETCH, buf, fetchLastErrString);
+	b = sumq_get(repo->spare);
+	b->len = b->nameslen = b->nrecs = b->nvals = b->descrslen = 0;
 
-	if ((a = archive_read_new()) == NULL)
-		errx(EXIT_FAILURE, "Cannot initialise archive");
+	return b;
+}
 
-#if ARCHIVE_VERSION_NUMBER < 3000000
-	if (archive_read_support_compression_all(a) != ARCHIVE_OK ||
-#else
-	if (archive_read_support_filter_all(a) != ARCHIVE_OK ||
+/*
+ * A pkg_summary being decompressed.  libarchive handles every compression,
+ * but only ever on one thread, so where liblzma can decode on several an xz
+ * summary is instead passed to it directly.
+ */
+typedef struct Sumdecoder {
+	struct archive	*a;
+#ifdef HAVE_LZMA_STREAM_DECODER_MT
+	lzma_stream	xz;
+	lzma_ret	xzret;
+	int		usexz;
 #endif
-	    archive_read_support_format_raw(a) != ARCHIVE_OK ||
-	    archive_read_open(a, sum, sum_start, sum_read, sum_close) != ARCHIVE_OK)
-		errx(EXIT_FAILURE, "Cannot open pkg_summary: %s",
-		    archive_error_string(a));
+} Sumdecoder;
 
-        if (archive_read_next_header(a, &ae) != ARCHIVE_OK)
-		errx(EXIT_FAILURE, "Cannot read pkg_summary: %s",
-		    archive_error_string(a));
+#ifdef HAVE_LZMA_STREAM_DECODER_MT
+/*
+ * Threads and memory for each xz decoder.  Every repository is decoded at
+ * the same time, so the threads are capped.  A decoder falls back to fewer
+ * threads past a quarter of physical memory, and fails past XZ_MEMLIMIT,
+ * which is far more than even an xz -9e summary needs on one thread.
+ */
+#define XZ_THREADS	4
+#define XZ_MEMLIMIT	(UINT64_C(512) * 1024 * 1024)
 
-	return a;
+/*
+ * Start decoding with one thread per online CPU, up to XZ_THREADS, if the
+ * summary is xz and there is more than one.  Blocks are only decoded in
+ * parallel if the file was written with several, as "xz -T" does, otherwise
+ * liblzma decodes it on a single thread just as libarchive would.
+ */
+static int
+decoder_open_xz(Sumrepo *repo, Sumdecoder *d)
+{
+	static const unsigned char magic[] = { 0xfd, '7', 'z', 'X', 'Z', 0 };
+	lzma_stream init = LZMA_STREAM_INIT;
+	lzma_mt mt;
+	long ncpu;
+
+	if (repo->datalen < sizeof(magic) ||
+	    memcmp(repo->data, magic, sizeof(magic)) != 0 ||
+	    (ncpu = sysconf(_SC_NPROCESSORS_ONLN)) < 2)
+		return 0;
+
+	if (ncpu > XZ_THREADS)
+		ncpu = XZ_THREADS;
+
+	memset(&mt, 0, sizeof(mt));
+	mt.flags = LZMA_CONCATENATED;
+	mt.threads = (uint32_t)ncpu;
+	mt.memlimit_threading = lzma_physmem() / 4;
+	mt.memlimit_stop = XZ_MEMLIMIT;
+
+	d->xz = init;
+	if (lzma_stream_decoder_mt(&d->xz, &mt) != LZMA_OK)
+		return 0;
+
+	d->xz.next_in = (const uint8_t *)repo->data;
+	d->xz.avail_in = repo->datalen;
+	d->xzret = LZMA_OK;
+
+	return 1;
 }
+#endif
 
-static void
-freecols(void)
+static int
+decoder_open(Sumrepo *repo, Sumdecoder *d)
 {
-	int i;
+	struct archive_entry *ae;
 
-	if (cols.name == NULL)
-		return;
+	memset(d, 0, sizeof(*d));
 
-	for (i = 0; i < cols.num; i++)
-		XFREE(cols.name[i]);
+#ifdef HAVE_LZMA_STREAM_DECODER_MT
+	if ((d->usexz = decoder_open_xz(repo, d)))
+		return 0;
+#endif
 
-	XFREE(cols.name);
-	XFREE(cols.len);
+	if ((d->a = archive_read_new()) == NULL) {
+		sumview_fail(repo, "Cannot initialise archive");
+		return -1;
+	}
 
-	cols.num = colcount = 0;
+#if ARCHIVE_VERSION_NUMBER < 3000000
+	if (archive_read_support_compression_all(d->a) != ARCHIVE_OK ||
+#else
+	if (archive_read_support_filter_all(d->a) != ARCHIVE_OK ||
+#endif
+	    archive_read_support_format_raw(d->a) != ARCHIVE_OK ||
+	    archive_read_open_memory(d->a, (void *)repo->data, repo->datalen)
+	    != ARCHIVE_OK) {
+		sumview_fail(repo, "Cannot open pkg_summary: %s",
+		    archive_error_string(d->a));
+		return -1;
+	}
+
+	if (archive_read_next_header(d->a, &ae) != ARCHIVE_OK) {
+		sumview_fail(repo, "Cannot read pkg_summary: %s",
+		    archive_error_string(d->a));
+		return -1;
+	}
+
+	return 0;
 }
 
-static void
-free_insertlist(void)
+/*
+ * Fill buf with up to len decompressed bytes, returning 0 at the end of the
+ * summary or -1 on error.
+ */
+static ssize_t
+decoder_read(Sumdecoder *d, char *buf, size_t len)
 {
-	Insertlist *pi;
+#ifdef HAVE_LZMA_STREAM_DECODER_MT
+	if (d->usexz) {
+		d->xz.next_out = (uint8_t *)buf;
+		d->xz.avail_out = len;
+		while (d->xz.avail_out > 0 && d->xzret == LZMA_OK)
+			d->xzret = lzma_code(&d->xz, LZMA_FINISH);
+		if (d->xzret != LZMA_OK && d->xzret != LZMA_STREAM_END)
+			return -1;
+		return (ssize_t)(len - d->xz.avail_out);
+	}
+#endif
+	return archive_read_data(d->a, buf, len);
+}
 
-	while (!SLIST_EMPTY(&inserthead)) {
-		pi = SLIST_FIRST(&inserthead);
-		SLIST_REMOVE_HEAD(&inserthead, next);
-		XFREE(pi->field);
-		XFREE(pi->value);
-		XFREE(pi);
+static const char *
+decoder_error(Sumdecoder *d)
+{
+#ifdef HAVE_LZMA_STREAM_DECODER_MT
+	if (d->usexz) {
+		switch (d->xzret) {
+		case LZMA_MEM_ERROR:
+			return "Cannot allocate memory";
+		case LZMA_MEMLIMIT_ERROR:
+			return "xz memory usage limit reached";
+		case LZMA_BUF_ERROR:
+			return "Truncated xz data";
+		default:
+			return "Corrupt xz data";
+		}
 	}
+#endif
+	return archive_error_string(d->a);
 }
 
-/**
- * sqlite callback, fill cols.name[] with available columns names
+static void
+decoder_close(Sumdecoder *d)
+{
+#ifdef HAVE_LZMA_STREAM_DECODER_MT
+	if (d->usexz) {
+		lzma_end(&d->xz);
+		return;
+	}
+#endif
+	if (d->a == NULL)
+		return;
+#if ARCHIVE_VERSION_NUMBER < 3000000
+	archive_read_finish(d->a);
+#else
+	archive_read_free(d->a);
+#endif
+}
+
+/*
+ * Decompress a fetched pkg_summary, passing it on to the parser in batches
+ * of complete package entries.  Returns 0 on success, or -1 with the
+ * repository marked as failed.
  */
-int
-colnames(void *unused, int argc, char **argv, char **colname)
+static int
+decode_summary(Sumrepo *repo)
 {
-	int i = 0;
+	Sumdecoder		d;
+	Sumbatch		*b, *next;
+	size_t			split;
+	ssize_t			r;
+	int			nbatches = 0, rv = -1;
 
-	colcount++;
+	if (decoder_open(repo, &d) < 0)
+		goto fail;
 
-	cols.num = colcount;
-	cols.name = xrealloc(cols.name, (size_t)colcount * sizeof(char *));
-	cols.len = xrealloc(cols.len, (size_t)colcount * sizeof(size_t));
+	b = get_batch(repo, &nbatches);
 
-	for (i = 0; i < argc; i++)
-		if (argv[i] != NULL && strncmp(colname[i], "name", 4) == 0) {
-			cols.name[colcount - 1] = xstrdup(argv[i]);
-			cols.len[colcount - 1] = strlen(argv[i]);
+	for (;;) {
+		r = decoder_read(&d, b->text + b->len, b->size - b->len);
+
+		if (r < 0) {
+			sumview_fail(repo, "Short read of pkg_summary: %s",
+			    decoder_error(&d));
+			free_batch(b);
+			goto fail;
 		}
 
-	return PDB_OK;
-}
+		b->len += (size_t)r;
+		if (r > 0 && b->len < b->size)
+			continue;
 
-/*
- * Prepared statements for the per-package INSERT and the per-row
- * CONFLICTS/DEPENDS/PROVIDES/REQUIRES/SUPERSEDES inserts, prepared once per
- * summary import.
- */
-static struct {
-	sqlite3_stmt	*pkg;
-	sqlite3_stmt	*conflicts;
-	sqlite3_stmt	*depends;
-	sqlite3_stmt	*provides;
-	sqlite3_stmt	*requires;
-	sqlite3_stmt	*supersedes;
-} stmts;
+		if (r == 0)
+			break;
 
-static sqlite3_stmt *
-prepare_stmt(const char *fmt, const char *table)
-{
-	char buf[BUFSIZ];
+		/*
+		 * The buffer is full.  Pass on everything up to the last empty
+		 * line and carry the remainder over to the next batch, growing
+		 * the buffer instead if not even one entry fits.
+		 */
+		for (split = b->len - 1; split > 0; split--) {
+			if (b->text[split] == '\n' &&
+			    b->text[split - 1] == '\n')
+				break;
+		}
+		if (split++ == 0) {
+			b->size *= 2;
+			b->text = xrealloc(b->text, b->size + 1);
+			continue;
+		}
 
-	snprintf(buf, BUFSIZ, fmt, table);
-	return pkgindb_stmt_prepare(buf);
+		next = get_batch(repo, &nbatches);
+		if (next->size < b->len - split) {
+			next->size = b->size;
+			next->text = xrealloc(next->text, next->size + 1);
+		}
+		next->len = b->len - split;
+		memcpy(next->text, b->text + split, next->len);
+
+		b->len = split;
+		b->text[b->len] = '\0';
+		sumq_put(repo->chunks, b);
+		b = next;
+	}
+
+	/*
+	 * End of the summary, pass on whatever is left.
+	 */
+	b->text[b->len] = '\0';
+	sumq_put(b->len ? repo->chunks : repo->spare, b);
+	rv = 0;
+
+fail:
+	decoder_close(&d);
+	return rv;
 }
 
 /*
- * Construct the package INSERT covering every column recorded in cols,
- * any columns not bound at execution are inserted as NULL.
+ * Return an empty batch for split_summary(), which has no text buffer of its
+ * own.
  */
-static sqlite3_stmt *
-prepare_pkg_stmt(struct Summary sum)
+static Sumbatch *
+get_mapped_batch(Sumrepo *repo, int *nbatches)
 {
-	char buf[BUFSIZ];
-	int i;
+	Sumbatch *b;
 
-	snprintf(buf, sizeof(buf), "INSERT INTO %s (", sum.pkg);
-	for (i = 0; i < cols.num; i++) {
-		if (i)
-			strlcat(buf, ",", sizeof(buf));
-		if (strlcat(buf, cols.name[i], sizeof(buf)) >= sizeof(buf))
-			errx(EXIT_FAILURE, "Increase query buffer");
+	if (*nbatches < SUMQUEUE_SIZE || repo->filter != NULL) {
+		(*nbatches)++;
+		return xcalloc(1, sizeof(Sumbatch));
 	}
-	strlcat(buf, ") VALUES (", sizeof(buf));
-	for (i = 0; i < cols.num; i++) {
-		if (strlcat(buf, i ? ",?" : "?", sizeof(buf)) >= sizeof(buf))
-			errx(EXIT_FAILURE, "Increase query buffer");
+
+	b = sumq_get(repo->spare);
+	b->len = b->nameslen = b->nrecs = b->nvals = b->descrslen = 0;
+	if (b->size > 0) {
+		free(b->text);
+		b->size = 0;
 	}
-	strlcat(buf, ");", sizeof(buf));
 
-	return pkgindb_stmt_prepare(buf);
+	return b;
 }
 
-static void
-prepare_stmts(struct Summary sum)
+/*
+ * Pass an uncompressed pkg_summary on to the parser straight from its private
+ * mapping, in batches of about SUMBATCH_SIZE that each end with an empty line.
+ * The newline of that empty line is overwritten by the terminating NUL, so
+ * nothing is copied unless the file does not end with a newline.
+ */
+static int
+split_summary(Sumrepo *repo)
 {
-	stmts.pkg = prepare_pkg_stmt(sum);
-	stmts.conflicts = prepare_stmt(INSERT_CONFLICTS, sum.conflicts);
-	stmts.depends = prepare_stmt(INSERT_DEPENDS, sum.depends);
-	stmts.provides = prepare_stmt(INSERT_PROVIDES, sum.provides);
-	stmts.requires = prepare_stmt(INSERT_REQUIRES, sum.requires);
-	if (sum.type == REMOTE_SUMMARY)
-		stmts.supersedes = prepare_stmt(INSERT_SUPERSEDES,
-		    sum.supersedes);
-}
+	Sumbatch	*b;
+	char		*p, *split, *end;
+	int		nbatches = 0;
+
+	end = repo->data + repo->datalen;
+
+	for (p = repo->data; p < end; p = split) {
+		split = end;
+		if ((size_t)(end - p) > SUMBATCH_SIZE) {
+			for (split = p + SUMBATCH_SIZE; split > p + 1;
+			    split--) {
+				if (split[-1] == '\n' && split[-2] == '\n')
+					break;
+			}
+			/* An entry larger than a batch, find where it ends. */
+			if (split == p + 1) {
+				for (split = p + SUMBATCH_SIZE; split < end;
+				    split++) {
+					if (split[-1] == '\n' &&
+					    split[-2] == '\n')
+						break;
+				}
+			}
+		}
 
-static void
-finalize_stmts(struct Summary sum)
-{
-	pkgindb_stmt_finalize(stmts.pkg);
-	pkgindb_stmt_finalize(stmts.conflicts);
-	pkgindb_stmt_finalize(stmts.depends);
-	pkgindb_stmt_finalize(stmts.provides);
-	pkgindb_stmt_finalize(stmts.requires);
-	if (sum.type == REMOTE_SUMMARY)
-		pkgindb_stmt_finalize(stmts.supersedes);
+		b = get_mapped_batch(repo, &nbatches);
+		if (split[-1] == '\n') {
+			b->text = p;
+			b->len = (size_t)(split - p) - 1;
+		} else {
+			b->size = (size_t)(split - p);
+			b->text = xmalloc(b->size + 1);
+			memcpy(b->text, p, b->size);
+			b->len = b->size;
+		}
+		b->text[b->len] = '\0';
+		sumq_put(repo->chunks, b);
+	}
+
+	return 0;
 }
 
 /*
- * Insert a pattern row (pkg_id, pattern, pkgbase) or a value row
- * (pkg_id, value) using a prepared statement.
+ * Parser thread, turning decoded batches into package records.  An invalid
+ * entry fails the repository, and the rest of it is then only handed back to
+ * the decoder, so that the writer rolls back what it has already imported.
  */
-static void
-insert_pattern(sqlite3_stmt *stmt, int pkgid, const char *pattern)
+static void *
+parse_summary(void *arg)
 {
-	char *pkgbase = pkgname_from_pattern(pattern);
+	Sumrepo		*repo = arg;
+	Sumbatch	*b;
+	const char	*bad;
+	int		failed = 0;
+
+	while ((b = sumq_get(repo->chunks)) != NULL) {
+		if (!failed && (bad = parse_batch(b)) != NULL) {
+			sumview_fail(repo, "Invalid pkg_info entry: %s", bad);
+			failed = 1;
+		}
+		if (!failed)
+			sumq_put(repo->batches, b);
+		else if (repo->filter != NULL)
+			free_batch(b);
+		else
+			sumq_put(repo->spare, b);
+	}
 
-	if (sqlite3_bind_int(stmt, 1, pkgid) != SQLITE_OK ||
-	    sqlite3_bind_text(stmt, 2, pattern, -1, SQLITE_STATIC) != SQLITE_OK ||
-	    sqlite3_bind_text(stmt, 3, pkgbase, -1, SQLITE_STATIC) != SQLITE_OK)
-		errx(EXIT_FAILURE, "Failed to bind %s", pattern);
+	sumq_close(repo->batches);
 
-	pkgindb_stmt_exec(stmt);
-	free(pkgbase);
+	return NULL;
 }
 
-static void
-insert_value(sqlite3_stmt *stmt, int pkgid, const char *value)
+/*
+ * The compressed pkg_summary of each remote repository is kept in
+ * pkgin_sumdir, named after the escaped repository URL and the suffix it was
+ * fetched with, and with the modification time the server sent.  When a
+ * repository has to be imported in full, for example after the database was
+ * recreated or with "pkgin -f update", those and its size are the validators
+ * of the request instead, and if it has not changed it is imported from here
+ * rather than downloaded again.  Local file:// repositories are not kept.
+ */
+static char *
+saved_summary(const char *url, const char *ext)
 {
-	if (sqlite3_bind_int(stmt, 1, pkgid) != SQLITE_OK ||
-	    sqlite3_bind_text(stmt, 2, value, -1, SQLITE_STATIC) != SQLITE_OK)
-		errx(EXIT_FAILURE, "Failed to bind %s", value);
+	static const char hex[] = "0123456789abcdef";
+	const char	*u;
+	char		*path, *p;
+
+	path = xmalloc(strlen(pkgin_sumdir) + strlen(url) * 3 +
+	    strlen(ext) + 3);
+	p = path + sprintf(path, "%s/", pkgin_sumdir);
+	for (u = url; *u != '\0'; u++) {
+		if (isalnum((unsigned char)*u) || *u == '.' || *u == '-' ||
+		    *u == '_')
+			*p++ = *u;
+		else {
+			*p++ = '%';
+			*p++ = hex[(unsigned char)*u >> 4];
+			*p++ = hex[(unsigned char)*u & 0xf];
+		}
+	}
+	sprintf(p, ".%s", ext);
 
-	pkgindb_stmt_exec(stmt);
+	return path;
 }
 
 /*
- * Bind the accumulated fields for a package to the prepared INSERT and
- * execute it.  Unbound columns are inserted as NULL.  Failures are logged
- * and skipped as they may be expected, for example UNIQUE constraint
- * violations when the same package exists in multiple repositories.
+ * Remove the kept copies of a repository, other than the one with suffix keep.
  */
 static void
-insert_pkg(int pkgid)
+remove_saved_summaries(const char *url, const char *keep)
 {
-	Insertlist	*pi;
-	int		i;
-
-	(void) sqlite3_clear_bindings(stmts.pkg);
-
-	SLIST_FOREACH(pi, &inserthead, next) {
-		for (i = 0; i < cols.num; i++) {
-			if (strcmp(pi->field, cols.name[i]) == 0) {
-				(void) sqlite3_bind_text(stmts.pkg, i + 1,
-				    pi->value, -1, SQLITE_STATIC);
-				break;
-			}
-		}
-	}
+	char	*path;
+	int	i;
 
-	for (i = 0; i < cols.num; i++) {
-		if (strcmp(cols.name[i], "PKG_ID") == 0) {
-			(void) sqlite3_bind_int(stmts.pkg, i + 1, pkgid);
-			break;
-		}
+	for (i = 0; sumexts[i] != NULL; i++) {
+		if (keep != NULL && strcmp(sumexts[i], keep) == 0)
+			continue;
+		path = saved_summary(url, sumexts[i]);
+		(void) unlink(path);
+		free(path);
 	}
-
-	(void) pkgindb_stmt_exec(stmts.pkg);
 }
 
-/**
- * add item to the main SLIST
+/*
+ * Use the kept copy as the validators for this update, if there is one.
  */
 static void
-add_to_slist(const char *field, const char *value)
+find_saved_summary(Sumrepo *repo)
 {
-	Insertlist	*insert;
+	struct stat	st;
+	char		*path;
+	int		i;
 
-	insert = xmalloc(sizeof(Insertlist));
-	insert->field = xstrdup(field);
-	insert->value = xstrdup(value);
+	if (strncmp(repo->url, "file://", 7) == 0)
+		return;
 
-	SLIST_INSERT_HEAD(&inserthead, insert, next);
+	for (i = 0; sumexts[i] != NULL; i++) {
+		path = saved_summary(repo->url, sumexts[i]);
+		if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+			repo->saved = path;
+			repo->ext = sumexts[i];
+			repo->mtime = st.st_mtime;
+			repo->dbsize = st.st_size;
+			repo->probe = 0;
+			return;
+		}
+		free(path);
+	}
 }
 
 /*
- * Parse a KEY=value line.
+ * Keep a downloaded pkg_summary that decoded successfully.  This is only a
+ * cache, so any failure just leaves whatever was there before.
  */
 static void
-parse_entry(struct Summary sum, int pkgid, char *line)
+save_summary(Sumrepo *repo)
 {
-	static uint8_t	check_machine_arch = 1;
-	int		i;
-	char		*val, *v, buf[BUFSIZ];
+	struct timeval	tv[2];
+	ssize_t		n;
+	size_t		off;
+	char		*path, *tmp;
+	int		fd;
 
-	if ((val = strchr(line, '=')) == NULL)
-		errx(EXIT_FAILURE, "Invalid pkg_info entry: %s", line);
+	if (strncmp(repo->url, "file://", 7) == 0)
+		return;
 
-	val++;
+	path = saved_summary(repo->url, repo->ext);
+	tmp = xasprintf("%s.tmp", path);
 
-	/*
-	 * Check MACHINE_ARCH of the package matches the local machine.
-	 */
-	if (check_machine_arch && strncmp(line, "MACHINE_ARCH=", 13) == 0) {
-		if (strncmp(MACHINE_ARCH, val, strlen(MACHINE_ARCH))) {
-			alarm(0); /* Stop the progress meter */
-			printf(MSG_ARCH_DONT_MATCH, val, MACHINE_ARCH);
-			if (!check_yesno(DEFAULT_NO))
-				exit(EXIT_FAILURE);
-			check_machine_arch = 0;
-			alarm(1); /* Restart progress XXX: UPDATE_INTERVAL */
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+		goto out;
+
+	for (off = 0; off < repo->datalen; off += (size_t)n) {
+		if ((n = write(fd, repo->data + off,
+		    repo->datalen - off)) < 0 && errno == EINTR)
+			n = 0;
+		else if (n < 0)
+			break;
+	}
+	if (close(fd) < 0 || off < repo->datalen) {
+		(void) unlink(tmp);
+		goto out;
+	}
+
+	memset(tv, 0, sizeof(tv));
+	tv[0].tv_sec = tv[1].tv_sec = repo->mtime;
+	if (utimes(tmp, tv) < 0 || rename(tmp, path) < 0) {
+		(void) unlink(tmp);
+		goto out;
+	}
+
+	remove_saved_summaries(repo->url, repo->ext);
+out:
+	free(tmp);
+	free(path);
+}
+
+/*
+ * Read the kept copy of an unchanged pkg_summary in place of downloading it.
+ */
+static int
+load_saved_summary(Sumrepo *repo)
+{
+	struct stat	st;
+	ssize_t		n;
+	size_t		off;
+	int		fd;
+
+	if ((fd = open(repo->saved, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+		sumview_fail(repo, "Cannot open %s: %s", repo->saved,
+		    strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	repo->datalen = (size_t)st.st_size;
+	repo->data = xmalloc(repo->datalen ? repo->datalen : 1);
+
+	for (off = 0; off < repo->datalen; off += (size_t)n) {
+		if ((n = read(fd, repo->data + off, repo->datalen - off)) < 0 &&
+		    errno == EINTR)
+			n = 0;
+		else if (n <= 0) {
+			sumview_fail(repo, "Cannot read %s: %s", repo->saved,
+			    n < 0 ? strerror(errno) : "truncated");
+			close(fd);
+			XFREE(repo->data);
+			return -1;
+		}
+	}
+	close(fd);
+
+	repo->size = (off_t)repo->datalen;
+	repo->replay = 1;
+
+	return 0;
+}
+
+/*
+ * Local file:// repositories are not read through libfetch, which would copy
+ * the whole file into memory, but mapped instead.  Only plain paths are, any
+ * that need decoding are left to libfetch.
+ */
+static int
+summary_mappable(const char *url)
+{
+	return strncmp(url, "file:///", 8) == 0 && strchr(url, '%') == NULL;
+}
+
+/*
+ * A compressed pkg_summary is made from the uncompressed one, so is usually a
+ * little newer even when both were written together.
+ */
+#define SUMMARY_MTIME_SLACK	300
+
+/*
+ * Map the pkg_summary of a local repository if it is newer than ours.
+ * Returns 0 if so, otherwise -1 with the repository set up-to-date or
+ * failed.  The mapping is private, and writable if it is uncompressed so that
+ * split_summary() can terminate batches in place.
+ *
+ * The most preferred suffix is used, unless another summary is newer by more
+ * than SUMMARY_MTIME_SLACK, so that one left behind by an older build does
+ * not hide the current one.
+ */
+static int
+map_summary(Sumrepo *repo)
+{
+	struct stat	st;
+	time_t		mtime[sizeof(sumexts) / sizeof(sumexts[0])], newest = -1;
+	char		*path = NULL;
+	void		*data;
+	int		fd = -1, i, serrno = ENOENT;
+
+	for (i = 0; sumexts[i] != NULL; i++) {
+		free(path);
+		path = xasprintf("%s/%s%s%s", repo->url + 7, PKG_SUMMARY,
+		    SUMEXT_DOT(sumexts[i]), sumexts[i]);
+		mtime[i] = -1;
+		if (stat(path, &st) < 0) {
+			if (errno != ENOENT)
+				serrno = errno;
+			continue;
+		}
+		mtime[i] = st.st_mtime;
+		if (mtime[i] > newest)
+			newest = mtime[i];
+	}
+
+	for (i = 0; newest >= 0 && sumexts[i] != NULL; i++) {
+		if (mtime[i] >= 0 && mtime[i] + SUMMARY_MTIME_SLACK >= newest)
+			break;
+	}
+
+	if (newest >= 0) {
+		free(path);
+		path = xasprintf("%s/%s%s%s", repo->url + 7, PKG_SUMMARY,
+		    SUMEXT_DOT(sumexts[i]), sumexts[i]);
+		if ((fd = open(path, O_RDONLY)) < 0)
+			serrno = errno;
+	}
+
+	if (fd < 0) {
+		sumview_fail(repo, MSG_COULDNT_FETCH, repo->url,
+		    strerror(serrno));
+		free(path);
+		return -1;
+	}
+
+	repo->ext = sumexts[i];
+
+	if (fstat(fd, &st) < 0) {
+		sumview_fail(repo, "Cannot read %s: %s", path,
+		    strerror(errno));
+		goto fail;
+	}
+
+	if (st.st_size == 0 || (uintmax_t)st.st_size > SSIZE_MAX) {
+		sumview_fail(repo, "Cannot read %s: %s", path,
+		    st.st_size == 0 ? "empty file" : strerror(EFBIG));
+		goto fail;
+	}
+
+	if (st.st_mtime <= repo->mtime) {
+		sumview_set(repo, SUM_UPTODATE);
+		goto fail;
+	}
+
+	if ((data = mmap(NULL, (size_t)st.st_size, *repo->ext == '\0' ?
+	    PROT_READ | PROT_WRITE : PROT_READ, MAP_PRIVATE, fd, 0))
+	    == MAP_FAILED) {
+		sumview_fail(repo, "Cannot map %s: %s", path, strerror(errno));
+		goto fail;
+	}
+	(void) posix_madvise(data, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+
+	repo->data = data;
+	repo->datalen = (size_t)st.st_size;
+	repo->mapped = 1;
+	repo->size = st.st_size;
+	repo->mtime = st.st_mtime;
+
+	close(fd);
+	free(path);
+	return 0;
+fail:
+	close(fd);
+	free(path);
+	return -1;
+}
+
+/*
+ * Release the compressed or mapped pkg_summary.
+ */
+static void
+release_summary(Sumrepo *repo)
+{
+	if (repo->data == NULL)
+		return;
+
+	if (repo->mapped)
+		(void) munmap(repo->data, repo->datalen);
+	else
+		free(repo->data);
+	repo->data = NULL;
+	repo->mapped = 0;
+}
+
+/*
+ * Open the pkg_summary with the given suffix.  Returns NULL if it is not
+ * available or, with *mtime set to -1, if it is not newer than ours.
+ */
+static Sumfile *
+open_summary(Sumrepo *repo, const char *ext, time_t *mtime, char *buf,
+    char *errmsg, size_t errlen)
+{
+	*mtime = repo->mtime; /* 0 sumtime == force reload */
+
+	snprintf(buf, BUFSIZ, "%s/%s%s%s", repo->url, PKG_SUMMARY,
+	    SUMEXT_DOT(ext), ext);
+
+	return sum_open(buf, mtime, repo->dbsize, errmsg, errlen);
+}
+
+/*
+ * Repository fetch thread.  Find the first available pkg_summary, and if it
+ * is newer than the one we have, download it and then run the decoder, with
+ * a separate parser thread, feeding the database writer.  Nothing here may
+ * touch the database.
+ */
+static void *
+fetch_summary(void *arg)
+{
+	Sumrepo		*repo = arg;
+	Sumfile		*sum = NULL;
+	const char	*tried = NULL;
+	pthread_t	parser;
+	time_t		mtime = 0;
+	int		i, rv;
+	char		buf[BUFSIZ], errmsg[BUFSIZ];
+
+	if (summary_mappable(repo->url)) {
+		if (map_summary(repo) < 0)
+			return NULL;
+		goto decode;
+	}
+
+	/*
+	 * Go straight to the suffix that was found last time, and only try
+	 * them all in order of preference if that fails or a probe is due.
+	 */
+	if (!repo->probe) {
+		sum = open_summary(repo, repo->ext, &mtime, buf, errmsg,
+		    sizeof(errmsg));
+		if (sum == NULL && mtime >= 0) {
+			tried = repo->ext;
+			repo->probe = 1;
+		}
+	}
+
+	for (i = 0; repo->probe && sumexts[i] != NULL; i++) {
+		if (sumexts[i] == tried || *sumexts[i] == '\0')
+			continue;
+
+		repo->ext = sumexts[i];
+
+		if ((sum = open_summary(repo, repo->ext, &mtime, buf, errmsg,
+		    sizeof(errmsg))) != NULL)
+			break; /* pkg_summary found and not up-to-date */
+
+		if (mtime < 0) /* pkg_summary found, but up-to-date */
+			break;
+	}
+
+	if (sum == NULL && mtime < 0 && repo->saved != NULL) {
+		/* Unchanged, but needs importing in full. */
+		if (load_saved_summary(repo) < 0)
+			return NULL;
+	} else if (sum == NULL && mtime < 0) {
+		sumview_set(repo, SUM_UPTODATE);
+		return NULL;
+	} else if (sum == NULL) {
+		sumview_fail(repo, MSG_COULDNT_FETCH, buf, errmsg);
+		return NULL;
+	} else {
+		repo->size = sum->size;
+		repo->mtime = mtime;
+		sumview_set(repo, SUM_FETCHING);
+
+		repo->data = sum_fetch(sum, repo, &repo->datalen);
+		sum_close(sum);
+
+		if (repo->data == NULL)
+			return NULL;
+
+		/* The server may not have sent a length, record what we got. */
+		repo->size = (off_t)repo->datalen;
+	}
+
+decode:
+	if (pthread_create(&parser, NULL, parse_summary, repo) != 0) {
+		sumview_fail(repo, "Cannot create parser thread");
+		release_summary(repo);
+		return NULL;
+	}
+
+	sumview_set(repo, SUM_DECODING);
+
+	if (*repo->ext == '\0')
+		rv = split_summary(repo);
+	else
+		rv = decode_summary(repo);
+
+	sumq_close(repo->chunks);
+	pthread_join(parser, NULL);
+
+	/* A damaged copy is removed so that the next update downloads it. */
+	if (rv == 0 && sumview_wait(repo) != SUM_FAILED) {
+		if (!repo->replay)
+			save_summary(repo);
+	} else if (repo->replay)
+		(void) unlink(repo->saved);
+
+	/* Batches from split_summary() still point into it. */
+	if (*repo->ext != '\0')
+		release_summary(repo);
+
+	return NULL;
+}
+
+static void
+freecols(void)
+{
+	int i;
+
+	if (cols.name == NULL)
+		return;
+
+	for (i = 0; i < cols.num; i++)
+		XFREE(cols.name[i]);
+
+	XFREE(cols.name);
+
+	cols.num = colcount = 0;
+}
+
+/**
+ * sqlite callback, fill cols.name[] with available columns names
+ */
+int
+colnames(void *unused, int argc, char **argv, char **colname)
+{
+	int i = 0;
+
+	colcount++;
+
+	cols.num = colcount;
+	cols.name = xrealloc(cols.name, (size_t)colcount * sizeof(char *));
+
+	for (i = 0; i < argc; i++)
+		if (argv[i] != NULL && strncmp(colname[i], "name", 4) == 0) {
+			cols.name[colcount - 1] = xstrdup(argv[i]);
+		}
+
+	return PDB_OK;
+}
+
+static int
+colindex(const char *name)
+{
+	int i;
+
+	for (i = 0; i < cols.num; i++) {
+		if (strcmp(cols.name[i], name) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * Record column names to cols, resetting any previous import.
+ */
+static void
+loadcols(struct Summary sum)
+{
+	int i;
+	char buf[BUFSIZ];
+
+	freecols();
+	cols.type = sum.type;
+	sqlite3_snprintf(BUFSIZ, buf, "PRAGMA table_info(%w);", sum.pkg);
+	pkgindb_doquery(buf, colnames, NULL);
+
+	for (i = 0; i < SUMKEY_HASH_SIZE; i++) {
+		if (sumkeys[i].name != NULL)
+			cols.key[sumkeys[i].key] = colindex(sumkeys[i].name);
+	}
+}
+
+/*
+ * Prepared statements for the per-package INSERT and the per-row
+ * CONFLICTS/DEPENDS/PROVIDES/REQUIRES/SUPERSEDES/DESCRIPTION inserts,
+ * prepared once per summary import.  Remote imports also look up which
+ * repository already has a package and delete individual packages from
+ * each of the sumsw tables.
+ */
+static struct {
+	sqlite3_stmt	*pkg;
+	sqlite3_stmt	*owner;
+	sqlite3_stmt	*conflicts;
+	sqlite3_stmt	*depends;
+	sqlite3_stmt	*provides;
+	sqlite3_stmt	*requires;
+	sqlite3_stmt	*supersedes;
+	sqlite3_stmt	*description;
+	sqlite3_stmt	*delete[8];	/* NULL terminated */
+} stmts;
+
+static sqlite3_stmt *
+prepare_stmt(const char *fmt, const char *table)
+{
+	char buf[BUFSIZ];
+
+	snprintf(buf, BUFSIZ, fmt, table);
+	return pkgindb_stmt_prepare(buf);
+}
+
+/*
+ * Construct the package INSERT covering every column recorded in cols,
+ * any columns not bound at execution are inserted as NULL.  A remote package
+ * that already exists is ignored rather than failing the UNIQUE constraint,
+ * so that duplicates do not go through the error log.
+ */
+static sqlite3_stmt *
+prepare_pkg_stmt(struct Summary sum)
+{
+	char buf[BUFSIZ];
+	int i;
+
+	snprintf(buf, sizeof(buf), "INSERT %sINTO %s (",
+	    sum.type == REMOTE_SUMMARY ? "OR IGNORE " : "", sum.pkg);
+	for (i = 0; i < cols.num; i++) {
+		if (i)
+			strlcat(buf, ",", sizeof(buf));
+		if (strlcat(buf, cols.name[i], sizeof(buf)) >= sizeof(buf))
+			errx(EXIT_FAILURE, "Increase query buffer");
+	}
+	strlcat(buf, ") VALUES (", sizeof(buf));
+	for (i = 0; i < cols.num; i++) {
+		if (strlcat(buf, i ? ",?" : "?", sizeof(buf)) >= sizeof(buf))
+			errx(EXIT_FAILURE, "Increase query buffer");
+	}
+	strlcat(buf, ");", sizeof(buf));
+
+	return pkgindb_stmt_prepare(buf);
+}
+
+/*
+ * Only remote SUPERSEDES and DESCRIPTION are supported, any local entries are
+ * ignored.
+ */
+static void
+prepare_stmts(struct Summary sum)
+{
+	const char **table;
+	int i = 0;
+
+	stmts.pkg = prepare_pkg_stmt(sum);
+	stmts.conflicts = prepare_stmt(INSERT_CONFLICTS, sum.conflicts);
+	stmts.depends = prepare_stmt(INSERT_DEPENDS, sum.depends);
+	stmts.provides = prepare_stmt(INSERT_PROVIDES, sum.provides);
+	stmts.requires = prepare_stmt(INSERT_REQUIRES, sum.requires);
+	if (sum.type == REMOTE_SUMMARY) {
+		stmts.owner = pkgindb_stmt_prepare(SELECT_REMOTE_PKG_OWNER);
+		stmts.supersedes = prepare_stmt(INSERT_SUPERSEDES,
+		    sum.supersedes);
+		stmts.description = prepare_stmt(INSERT_DESCRIPTION,
+		    sum.description);
+		for (table = &(sum.pkg); *table != NULL; ++table)
+			stmts.delete[i++] = prepare_stmt(DELETE_REMOTE_PKG_ID,
+			    *table);
+	} else {
+		stmts.owner = NULL;
+		stmts.supersedes = NULL;
+		stmts.description = NULL;
+	}
+	stmts.delete[i] = NULL;
+}
+
+static void
+finalize_stmts(void)
+{
+	int i;
+
+	pkgindb_stmt_finalize(stmts.pkg);
+	pkgindb_stmt_finalize(stmts.conflicts);
+	pkgindb_stmt_finalize(stmts.depends);
+	pkgindb_stmt_finalize(stmts.provides);
+	pkgindb_stmt_finalize(stmts.requires);
+	if (stmts.owner != NULL)
+		pkgindb_stmt_finalize(stmts.owner);
+	if (stmts.supersedes != NULL)
+		pkgindb_stmt_finalize(stmts.supersedes);
+	if (stmts.description != NULL)
+		pkgindb_stmt_finalize(stmts.description);
+	for (i = 0; stmts.delete[i] != NULL; i++)
+		pkgindb_stmt_finalize(stmts.delete[i]);
+}
+
+/*
+ * Insert a pattern row (pkg_id, pattern, pkgbase) or a value row
+ * (pkg_id, value) using a prepared statement.
+ */
+static void
+insert_pattern(sqlite3_stmt *stmt, int64_t pkgid, const char *pattern)
+{
+	int len = pkgname_from_pattern(pattern);
+
+	if (sqlite3_bind_int64(stmt, 1, pkgid) != SQLITE_OK ||
+	    sqlite3_bind_text(stmt, 2, pattern, -1,
+	    SQLITE_STATIC) != SQLITE_OK ||
+	    (len < 0 ? sqlite3_bind_null(stmt, 3) :
+	    sqlite3_bind_text(stmt, 3, pattern, len,
+	    SQLITE_STATIC)) != SQLITE_OK)
+		errx(EXIT_FAILURE, "Failed to bind %s", pattern);
+
+	pkgindb_stmt_exec(stmt);
+}
+
+static void
+insert_value(sqlite3_stmt *stmt, int64_t pkgid, const char *value)
+{
+	if (sqlite3_bind_int64(stmt, 1, pkgid) != SQLITE_OK ||
+	    sqlite3_bind_text(stmt, 2, value, -1, SQLITE_STATIC) != SQLITE_OK)
+		errx(EXIT_FAILURE, "Failed to bind %s", value);
+
+	pkgindb_stmt_exec(stmt);
+}
+
+/*
+ * Insert a parsed package record, returning its new PKG_ID or -1 if it could
+ * not be inserted, including a remote package that already exists.  Unset
+ * columns are inserted as NULL.  The multi-valued entries are only inserted
+ * once the package itself has been.
+ */
+static int64_t
+insert_pkg(Sumbatch *b, Sumrec *rec, const char *repository)
+{
+	static uint8_t	check_machine_arch = 1;
+	Sumval		*v;
+	int64_t		pkgid;
+	size_t		n;
+	int		i;
+
+	/*
+	 * Check MACHINE_ARCH of the package matches the local machine.
+	 */
+	if (check_machine_arch && rec->arch != NULL &&
+	    strncmp(MACHINE_ARCH, rec->arch, strlen(MACHINE_ARCH))) {
+		sumview_suspend();
+		printf(MSG_ARCH_DONT_MATCH, rec->arch, MACHINE_ARCH);
+		if (!check_yesno(DEFAULT_NO))
+			exit(EXIT_FAILURE);
+		check_machine_arch = 0;
+		sumview_resume();
+	}
+
+	(void) sqlite3_clear_bindings(stmts.pkg);
+
+	for (i = 0; i < cols.num; i++) {
+		if (rec->col[i].value != NULL)
+			(void) sqlite3_bind_text(stmts.pkg, i + 1,
+			    rec->col[i].value, rec->col[i].len, SQLITE_STATIC);
+	}
+
+	if (cols.key[SUMKEY_REPOSITORY] >= 0 && repository != NULL)
+		(void) sqlite3_bind_text(stmts.pkg,
+		    cols.key[SUMKEY_REPOSITORY] + 1, repository, -1,
+		    SQLITE_STATIC);
+
+	/* PKG_ID is left unbound, and so assigned by sqlite. */
+	if (pkgindb_stmt_exec(stmts.pkg) != PDB_OK || pkgindb_changes() == 0)
+		return -1;
+
+	pkgid = pkgindb_last_insert_id();
+
+	for (n = 0; n < rec->nvals; n++) {
+		v = &b->vals[rec->val + n];
+		switch (v->type) {
+		case SUMKEY_CONFLICTS:
+			insert_pattern(stmts.conflicts, pkgid, v->value);
+			break;
+		case SUMKEY_DEPENDS:
+			insert_pattern(stmts.depends, pkgid, v->value);
+			break;
+		case SUMKEY_PROVIDES:
+			insert_value(stmts.provides, pkgid, v->value);
+			break;
+		case SUMKEY_REQUIRES:
+			insert_value(stmts.requires, pkgid, v->value);
+			break;
+		case SUMKEY_SUPERSEDES:
+			if (stmts.supersedes != NULL)
+				insert_pattern(stmts.supersedes, pkgid,
+				    v->value);
+			break;
+		}
+	}
+
+	if (rec->descrlen > 0 && stmts.description != NULL) {
+		if (sqlite3_bind_int64(stmts.description, 1, pkgid)
+		    != SQLITE_OK ||
+		    (rec->descrsize > 0 ?
+		    sqlite3_bind_int64(stmts.description, 2,
+		    (int64_t)rec->descrsize) :
+		    sqlite3_bind_null(stmts.description, 2)) != SQLITE_OK ||
+		    sqlite3_bind_blob(stmts.description, 3,
+		    b->descrs + rec->descr, (int)rec->descrlen,
+		    SQLITE_STATIC) != SQLITE_OK)
+			errx(EXIT_FAILURE, "Failed to bind description");
+		pkgindb_stmt_exec(stmts.description);
+	}
+
+	return pkgid;
+}
+
+/*
+ * Delete a remote package along with its multi-valued entries.
+ */
+static void
+delete_pkg(int64_t pkgid)
+{
+	int i;
+
+	for (i = 0; stmts.delete[i] != NULL; i++) {
+		if (sqlite3_bind_int64(stmts.delete[i], 1, pkgid) != SQLITE_OK)
+			errx(EXIT_FAILURE, "Failed to bind %" PRId64, pkgid);
+		pkgindb_stmt_exec(stmts.delete[i]);
+	}
+}
+
+/*
+ * Repositories are preferred in the order they are configured, unknown ones
+ * coming last.
+ */
+static int
+repo_priority(const char *url)
+{
+	int i;
+
+	for (i = 0; pkg_repos[i] != NULL; i++) {
+		if (strcmp(pkg_repos[i], url) == 0)
+			break;
+	}
+
+	return i;
+}
+
+/*
+ * When the same FULLPKGNAME is available from more than one repository, the
+ * one listed first provides it.  Called when a package could not be inserted
+ * because it already exists: if it came from a repository listed after this
+ * one it is deleted so that this one can take its place, and 1 is returned.
+ * Otherwise this package is the one skipped.
+ */
+static int
+take_over_pkg(Sumrepo *repo, const char *fullpkgname)
+{
+	const char	*owner;
+	int64_t		pkgid = 0;
+	int		take = 0;
+
+	if (sqlite3_bind_text(stmts.owner, 1, fullpkgname, -1,
+	    SQLITE_STATIC) != SQLITE_OK)
+		errx(EXIT_FAILURE, "Failed to bind %s", fullpkgname);
+
+	if (sqlite3_step(stmts.owner) == SQLITE_ROW) {
+		pkgid = sqlite3_column_int64(stmts.owner, 0);
+		owner = (const char *)sqlite3_column_text(stmts.owner, 1);
+		take = (owner == NULL ||
+		    repo_priority(owner) > repo_priority(repo->url));
+	}
+	(void) sqlite3_reset(stmts.owner);
+
+	if (take)
+		delete_pkg(pkgid);
+
+	return take;
+}
+
+static void
+add_value(Sumbatch *b, Sumrec *rec, int type, const char *value)
+{
+	if (b->nvals == b->valsz) {
+		b->valsz = b->valsz ? b->valsz * 2 : 256;
+		b->vals = xrealloc(b->vals, b->valsz * sizeof(Sumval));
+	}
+
+	b->vals[b->nvals].type = type;
+	b->vals[b->nvals].value = value;
+	b->nvals++;
+	rec->nvals++;
+}
+
+static void
+set_col(Sumrec *rec, int key, const char *value, size_t len)
+{
+	int i = cols.key[key];
+
+	if (i >= 0) {
+		rec->col[i].value = value;
+		rec->col[i].len = (int)len;
+	}
+}
+
+/*
+ * Parse a KEY=value line into a record, ignoring any unknown keys.  If a key
+ * is repeated the first value is used.  Returns -1 if the line is not a
+ * KEY=value entry.
+ */
+static int
+parse_entry(Sumbatch *b, Sumrec *rec, char *line, size_t linelen)
+{
+	const struct sumkey	*k;
+	size_t			len;
+	char			*val, *v;
+
+	if ((val = memchr(line, '=', linelen)) == NULL)
+		return -1;
+
+	if ((len = (size_t)(val - line)) == 0)
+		return 0;
+
+	k = &sumkeys[SUMKEY_HASH(line, len)];
+	if (k->name == NULL || k->len != len || memcmp(line, k->name, len))
+		return 0;
+
+	val++;
+	len = linelen - len - 1;
+
+	switch (k->key) {
+	case SUMKEY_MACHINE_ARCH:
+		if (rec->arch == NULL)
+			rec->arch = val;
+		return 0;
+	case SUMKEY_CONFLICTS:
+	case SUMKEY_DEPENDS:
+	case SUMKEY_PROVIDES:
+	case SUMKEY_REQUIRES:
+	case SUMKEY_SUPERSEDES:
+		add_value(b, rec, k->key, val);
+		return 0;
+	/*
+	 * Each line of a DESCRIPTION is an entry of its own, and they are
+	 * joined up again by pack_description().  Only remote ones are kept.
+	 */
+	case SUMKEY_DESCRIPTION:
+		if (cols.type == REMOTE_SUMMARY)
+			add_value(b, rec, k->key, val);
+		return 0;
+	}
+
+	/*
+	 * Skip empty values like LICENSE=
+	 */
+	if (*val == '\0')
+		return 0;
+
+	/*
+	 * Handle remaining columns.
+	 */
+	if (cols.key[k->key] < 0 || rec->col[cols.key[k->key]].value != NULL)
+		return 0;
+
+	if (k->key != SUMKEY_PKGNAME) {
+		set_col(rec, k->key, val, len);
+		return 0;
+	}
+
+	/*
+	 * Split PKGNAME into parts.  Some rare packages have no version, and
+	 * so are given a FULLPKGNAME of PKGNAME-0.0.
+	 */
+	if (exact_pkgfmt(val)) {
+		set_col(rec, SUMKEY_FULLPKGNAME, val, len);
+		if ((v = strrchr(val, '-')) != NULL) {
+			set_col(rec, SUMKEY_PKGNAME, val, (size_t)(v - val));
+			set_col(rec, SUMKEY_PKGVERS, v + 1,
+			    len - (size_t)(v - val) - 1);
+		} else
+			set_col(rec, SUMKEY_PKGNAME, val, len);
+	} else {
+		if (b->names == NULL)
+			b->names = xmalloc(b->namessz);
+		v = b->names + b->nameslen;
+		b->nameslen += (size_t)sprintf(v, "%s-0.0", val) + 1;
+		set_col(rec, SUMKEY_FULLPKGNAME, v, len + 4);
+		set_col(rec, SUMKEY_PKGNAME, val, len);
+		set_col(rec, SUMKEY_PKGVERS, "0.0", 3);
+	}
+
+	return 0;
+}
+
+static Sumrec *
+add_rec(Sumbatch *b)
+{
+	Sumrec *rec;
+
+	if (b->nrecs == b->recsz) {
+		b->recsz = b->recsz ? b->recsz * 2 : 128;
+		b->recs = xrealloc(b->recs, b->recsz * sizeof(Sumrec));
+		b->colv = xrealloc(b->colv,
+		    b->recsz * (size_t)cols.num * sizeof(Sumcol));
+	}
+
+	rec = &b->recs[b->nrecs];
+	rec->col = &b->colv[b->nrecs * (size_t)cols.num];
+	memset(rec->col, 0, (size_t)cols.num * sizeof(Sumcol));
+	rec->arch = NULL;
+	rec->val = b->nvals;
+	rec->nvals = 0;
+	rec->descrlen = rec->descrsize = 0;
+	rec->skip = 0;
+	b->nrecs++;
+
+	return rec;
+}
+
+static char *
+grow_descrs(Sumbatch *b, size_t len)
+{
+	if (b->descrslen + len > b->descrssz) {
+		while (b->descrslen + len > b->descrssz)
+			b->descrssz = b->descrssz ? b->descrssz * 2 : 65536;
+		b->descrs = xrealloc(b->descrs, b->descrssz);
+	}
+
+	return b->descrs + b->descrslen;
+}
+
+/*
+ * Join the DESCRIPTION lines of a record into the batch descrs, and deflate
+ * them if zlib is available.  This is done by the parser so that the writer
+ * only has to store the result.
+ *
+ * Descriptions are short and deflated one at a time, so the stream is set up
+ * with a small window and hash to make resetting it for each one cheap.
+ */
+static void
+pack_description(Sumbatch *b, Sumrec *rec)
+{
+	Sumval	*v;
+	size_t	n, vlen, len = 0;
+	char	*p;
+
+	for (n = 0; n < rec->nvals; n++) {
+		v = &b->vals[rec->val + n];
+		if (v->type == SUMKEY_DESCRIPTION)
+			len += strlen(v->value) + 1;
+	}
+	if (len == 0)
+		return;
+
+	/*
+	 * Join them up at the end of descrs, where they are deflated from
+	 * into the space that follows.
+	 */
+	p = grow_descrs(b, len);
+	for (n = 0; n < rec->nvals; n++) {
+		v = &b->vals[rec->val + n];
+		if (v->type != SUMKEY_DESCRIPTION)
+			continue;
+		vlen = strlen(v->value);
+		memcpy(p, v->value, vlen);
+		p[vlen] = '\n';
+		p += vlen + 1;
+	}
+	rec->descr = b->descrslen;
+	rec->descrlen = len;
+
+#ifdef HAVE_ZLIB
+	if (b->zs == NULL) {
+		b->zs = xcalloc(1, sizeof(z_stream));
+		if (deflateInit2(b->zs, Z_BEST_SPEED, Z_DEFLATED, -12,
+		    4, Z_DEFAULT_STRATEGY) != Z_OK)
+			errx(EXIT_FAILURE, "Cannot initialise zlib");
+	} else
+		(void) deflateReset(b->zs);
+
+	(void) grow_descrs(b, len + deflateBound(b->zs, len));
+	b->zs->next_in = (Bytef *)b->descrs + rec->descr;
+	b->zs->avail_in = (uInt)len;
+	b->zs->next_out = (Bytef *)b->descrs + rec->descr + len;
+	b->zs->avail_out = (uInt)(b->descrssz - rec->descr - len);
+
+	/* Keep the text as it is if it does not get any smaller. */
+	if (deflate(b->zs, Z_FINISH) == Z_STREAM_END &&
+	    b->zs->total_out < len) {
+		memmove(b->descrs + rec->descr, b->descrs + rec->descr + len,
+		    b->zs->total_out);
+		rec->descrlen = b->zs->total_out;
+		rec->descrsize = len;
+	}
+#endif
+
+	b->descrslen += rec->descrlen;
+}
+
+/*
+ * Parse a batch of package entries into records.  Packages are delimited by
+ * an empty line, the final entry may not be terminated by one.
+ *
+ * This is a single pass over the text, with memchr() finding the end of each
+ * line, and an empty line ending the current package.  Returns the first
+ * invalid entry, or NULL if there were none.
+ */
+static const char *
+parse_batch(Sumbatch *b)
+{
+	Sumrec	*rec = NULL;
+	size_t	i, len;
+	char	*line, *nl, *end = b->text + b->len;
+
+	/* Any FULLPKGNAME copies are shorter than their PKGNAME= line. */
+	if (b->namessz < b->len + 1) {
+		XFREE(b->names);
+		b->namessz = b->len + 1;
+	}
+
+	for (line = b->text; line < end; line = nl + 1) {
+		if ((nl = memchr(line, '\n', (size_t)(end - line))) == NULL)
+			nl = end;
+		*nl = '\0';
+		len = (size_t)(nl - line);
+		if (len > 0 && line[len - 1] == '\r')
+			line[--len] = '\0';
+
+		if (len == 0) {
+			rec = NULL;
+			continue;
+		}
+
+		if (rec == NULL)
+			rec = add_rec(b);
+		if (parse_entry(b, rec, line, len) < 0)
+			return line;
+	}
+
+	/* colv may have moved while growing. */
+	for (i = 0; i < b->nrecs; i++) {
+		b->recs[i].col = &b->colv[i * (size_t)cols.num];
+		if (cols.type == REMOTE_SUMMARY)
+			pack_description(b, &b->recs[i]);
+	}
+
+	return NULL;
+}
+
+/*
+ * Import installed packages, read into a batch of pkg_summary entries, into
+ * the local summary.
+ */
+static void
+insert_local_summary(Sumbatch *b)
+{
+	const char	*bad;
+	size_t		i;
+	uint64_t	savepoint;
+
+	loadcols(sumsw[LOCAL_SUMMARY]);
+	if ((bad = parse_batch(b)) != NULL)
+		errx(EXIT_FAILURE, "Invalid pkg_info entry: %s", bad);
+
+	prepare_stmts(sumsw[LOCAL_SUMMARY]);
+
+	savepoint = pkgindb_savepoint();
+
+	for (i = 0; i < b->nrecs; i++)
+		(void) insert_pkg(b, &b->recs[i], NULL);
+
+	pkgindb_savepoint_release(savepoint);
+
+	finalize_stmts();
+	free_batch(b);
+}
+
+/*
+ * Packages currently imported from a repository, looked up by FULLPKGNAME
+ * while importing its new pkg_summary to find out what changed.
+ */
+typedef struct Sumpkg {
+	char		*fullpkgname;
+	char		*build_date;
+	int64_t		pkg_id;
+	int		seen;
+	SLIST_ENTRY(Sumpkg) next;
+} Sumpkg;
+
+SLIST_HEAD(Sumpkghead, Sumpkg);
+
+static int
+load_sumpkg(void *param, int argc, char **argv, char **colname)
+{
+	struct Sumpkghead	*sumpkgs = param;
+	Sumpkg			*p;
+
+	if (argv == NULL || argv[1] == NULL)
+		return PDB_ERR;
+
+	p = xmalloc(sizeof(Sumpkg));
+	p->pkg_id = strtoll(argv[0], NULL, 10);
+	p->fullpkgname = xstrdup(argv[1]);
+	p->build_date = argv[2] ? xstrdup(argv[2]) : NULL;
+	p->seen = 0;
+	SLIST_INSERT_HEAD(&sumpkgs[pkg_hash_entry(p->fullpkgname,
+	    REMOTE_PKG_HASH_SIZE)], p, next);
+
+	return PDB_OK;
+}
+
+static Sumpkg *
+find_sumpkg(struct Sumpkghead *sumpkgs, const char *fullpkgname)
+{
+	Sumpkg *p;
+
+	SLIST_FOREACH(p, &sumpkgs[pkg_hash_entry(fullpkgname,
+	    REMOTE_PKG_HASH_SIZE)], next) {
+		if (strcmp(p->fullpkgname, fullpkgname) == 0)
+			return p;
+	}
+
+	return NULL;
+}
+
+static void
+add_sumchange(Sumdiff *diff, sumchange_t type, const char *fullpkgname)
+{
+	Sumchange *c;
+
+	switch (type) {
+	case SUMDIFF_ADDED:
+		diff->added++;
+		break;
+	case SUMDIFF_REMOVED:
+		diff->removed++;
+		break;
+	case SUMDIFF_REBUILT:
+		diff->rebuilt++;
+		break;
+	}
+
+	c = xmalloc(sizeof(Sumchange));
+	c->type = type;
+	c->fullpkgname = xstrdup(fullpkgname);
+	SLIST_INSERT_HEAD(&diff->changes, c, next);
+}
+
+static void
+free_sumdiff(Sumdiff *diff)
+{
+	Sumchange *c;
+
+	while (!SLIST_EMPTY(&diff->changes)) {
+		c = SLIST_FIRST(&diff->changes);
+		SLIST_REMOVE_HEAD(&diff->changes, next);
+		free(c->fullpkgname);
+		free(c);
+	}
+
+	memset(diff, 0, sizeof(Sumdiff));
+}
+
+/*
+ * A subscription restricts a repository to the packages that match any of
+ * its rules, along with everything they depend on.  They are read from
+ * subscriptions.conf, where each line is a repository URL glob followed by
+ * one of:
+ *
+ *	category <glob>		any of the package CATEGORIES matches
+ *	pkgpath <glob>		PKGPATH matches
+ *	pkgname <glob>		PKGNAME matches
+ *	keep			PKGNAME is installed and not automatic
+ *
+ * The subscription text kept in Sumrepo.filter has one line per rule, with
+ * "keep" expanded to the packages it currently stands for, so that comparing
+ * it against REPO_FILTER tells whether the repository needs importing again.
+ */
+typedef enum sumrule_t {
+	SUMRULE_CATEGORY,
+	SUMRULE_PKGPATH,
+	SUMRULE_PKGNAME,
+} sumrule_t;
+
+typedef struct Sumrule {
+	sumrule_t	type;
+	char		*glob;
+} Sumrule;
+
+static const char *const sumrules[] = {
+	[SUMRULE_CATEGORY]	= "category",
+	[SUMRULE_PKGPATH]	= "pkgpath",
+	[SUMRULE_PKGNAME]	= "pkgname",
+};
+
+static void
+add_rule(Sumrepo *repo, sumrule_t type, const char *glob)
+{
+	char *filter;
+
+	repo->rules = xrealloc(repo->rules,
+	    (size_t)(repo->nrules + 1) * sizeof(Sumrule));
+	repo->rules[repo->nrules].type = type;
+	repo->rules[repo->nrules].glob = xstrdup(glob);
+	repo->nrules++;
+
+	filter = xasprintf("%s%s %s\n", repo->filter ? repo->filter : "",
+	    sumrules[type], glob);
+	free(repo->filter);
+	repo->filter = filter;
+}
+
+static int
+add_keep_rule(void *param, int argc, char **argv, char **colname)
+{
+	if (argv == NULL || argv[0] == NULL)
+		return PDB_ERR;
+
+	add_rule(param, SUMRULE_PKGNAME, argv[0]);
+
+	return PDB_OK;
+}
+
+static void
+load_subscriptions(Sumrepo *repos, int count)
+{
+	FILE		*fp;
+	size_t		len = 0;
+	int		i, lineno = 0;
+	sumrule_t	type;
+	char		*line = NULL, *last, *url, *rule, *glob;
+
+	if ((fp = fopen(PKGIN_CONF"/"SUBS_FILE, "r")) == NULL)
+		return;
+
+	while (getline(&line, &len, fp) > 0) {
+		lineno++;
+
+		if ((url = strtok_r(line, " \t\r\n", &last)) == NULL ||
+		    *url == '#')
+			continue;
+		rule = strtok_r(NULL, " \t\r\n", &last);
+		glob = strtok_r(NULL, " \t\r\n", &last);
+
+		if (rule != NULL && strcmp(rule, "keep") == 0) {
+			if (glob != NULL)
+				errx(EXIT_FAILURE, MSG_BAD_SUBSCRIPTION,
+				    lineno);
+			for (i = 0; i < count; i++) {
+				if (fnmatch(url, repos[i].url, 0) != 0)
+					continue;
+				/* Subscribed even if nothing is kept. */
+				if (repos[i].filter == NULL)
+					repos[i].filter = xstrdup("");
+				pkgindb_doquery(SELECT_KEEP_PKGNAMES,
+				    add_keep_rule, &repos[i]);
+			}
+			continue;
+		}
+
+		for (type = SUMRULE_CATEGORY; type <= SUMRULE_PKGNAME; type++) {
+			if (rule != NULL && strcmp(rule, sumrules[type]) == 0)
+				break;
+		}
+		if (type > SUMRULE_PKGNAME || glob == NULL ||
+		    strtok_r(NULL, " \t\r\n", &last) != NULL)
+			errx(EXIT_FAILURE, MSG_BAD_SUBSCRIPTION, lineno);
+
+		for (i = 0; i < count; i++) {
+			if (fnmatch(url, repos[i].url, 0) == 0)
+				add_rule(&repos[i], type, glob);
+		}
+	}
+
+	free(line);
+	fclose(fp);
+}
+
+static void
+free_subscription(Sumrepo *repo)
+{
+	int i;
+
+	for (i = 0; i < repo->nrules; i++)
+		free(repo->rules[i].glob);
+	XFREE(repo->rules);
+	XFREE(repo->filter);
+	repo->nrules = 0;
+}
+
+/*
+ * A package of a filtered repository, see select_subscribed().
+ */
+typedef struct Sumsub {
+	const char	*name;		/* PKGNAME, not NUL terminated */
+	size_t		len;
+	const char	*full;
+	Sumbatch	*b;
+	Sumrec		*rec;
+} Sumsub;
+
+static int
+subcmp(const char *name, size_t len, const Sumsub *sub)
+{
+	int rv;
+
+	if ((rv = memcmp(name, sub->name,
+	    len < sub->len ? len : sub->len)) != 0)
+		return rv;
+
+	return (len > sub->len) - (len < sub->len);
+}
+
+static int
+sort_subs(const void *a, const void *b)
+{
+	const Sumsub *sa = a;
+
+	return subcmp(sa->name, sa->len, b);
+}
+
+/*
+ * Return the index of the first package called name, or where it would be.
+ */
+static size_t
+find_sub(Sumsub *subs, size_t nsubs, const char *name, size_t len)
+{
+	size_t lo = 0, hi = nsubs, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (subcmp(name, len, &subs[mid]) > 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static int
+fnmatch_len(const char *glob, const char *value, size_t len)
+{
+	char buf[BUFSIZ];
+
+	if (len >= sizeof(buf))
+		return 0;
+
+	memcpy(buf, value, len);
+	buf[len] = '\0';
+
+	return fnmatch(glob, buf, 0) == 0;
+}
+
+static int
+subscribed(Sumrepo *repo, Sumsub *sub)
+{
+	const char	*v;
+	size_t		len;
+	int		i;
+
+	for (i = 0; i < repo->nrules; i++) {
+		switch (repo->rules[i].type) {
+		case SUMRULE_CATEGORY:
+			if (cols.key[SUMKEY_CATEGORIES] < 0 ||
+			    (v = sub->rec->col[
+			    cols.key[SUMKEY_CATEGORIES]].value) == NULL)
+				break;
+			for (; *v != '\0'; v += len) {
+				v += strspn(v, " \t");
+				len = strcspn(v, " \t");
+				if (len > 0 && fnmatch_len(repo->rules[i].glob,
+				    v, len))
+					return 1;
+			}
+			break;
+		case SUMRULE_PKGPATH:
+			if (cols.key[SUMKEY_PKGPATH] < 0 || (v = sub->rec->col[
+			    cols.key[SUMKEY_PKGPATH]].value) == NULL)
+				break;
+			if (fnmatch(repo->rules[i].glob, v, 0) == 0)
+				return 1;
+			break;
+		case SUMRULE_PKGNAME:
+			if (fnmatch_len(repo->rules[i].glob, sub->name,
+			    sub->len))
+				return 1;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Mark every package of a filtered repository to be skipped, except for
+ * those it is subscribed to and, recursively, any package in the repository
+ * that satisfies one of their DEPENDS.  Packages are sorted by PKGNAME so
+ * that most patterns only need to be matched against a few candidates.
+ */
+static void
+select_subscribed(Sumrepo *repo, Sumbatch **held, size_t nheld)
+{
+	Sumsub		*subs, *sub;
+	Sumval		*v;
+	Sumrec		*rec;
+	size_t		nsubs = 0, i, j, n, head = 0, tail = 0, *queue;
+	int		len;
+
+	for (i = 0; i < nheld; i++)
+		nsubs += held[i]->nrecs;
+	subs = xmalloc((nsubs ? nsubs : 1) * sizeof(Sumsub));
+
+	nsubs = 0;
+	for (i = 0; i < nheld; i++) {
+		for (j = 0; j < held[i]->nrecs; j++) {
+			rec = &held[i]->recs[j];
+			rec->skip = 1;
+			sub = &subs[nsubs];
+			if ((sub->full = rec->col[cols.key[SUMKEY_FULLPKGNAME]]
+			    .value) == NULL)
+				continue;
+			sub->name = rec->col[cols.key[SUMKEY_PKGNAME]].value;
+			sub->len = (size_t)rec->col[cols.key[SUMKEY_PKGNAME]]
+			    .len;
+			sub->b = held[i];
+			sub->rec = rec;
+			nsubs++;
+		}
+	}
+
+	qsort(subs, nsubs, sizeof(Sumsub), sort_subs);
+
+	/*
+	 * Breadth-first from the subscribed packages, marking each one that
+	 * is reached as wanted before it is queued.
+	 */
+	queue = xmalloc((nsubs ? nsubs : 1) * sizeof(size_t));
+	for (i = 0; i < nsubs; i++) {
+		if (subscribed(repo, &subs[i])) {
+			subs[i].rec->skip = 0;
+			queue[tail++] = i;
+		}
+	}
+
+	while (head < tail) {
+		sub = &subs[queue[head++]];
+		for (n = 0; n < sub->rec->nvals; n++) {
+			v = &sub->b->vals[sub->rec->val + n];
+			if (v->type != SUMKEY_DEPENDS)
+				continue;
+			if ((len = pkgname_from_pattern(v->value)) < 0)
+				i = 0;
+			else
+				i = find_sub(subs, nsubs, v->value,
+				    (size_t)len);
+			for (; i < nsubs; i++) {
+				if (len >= 0 && subcmp(v->value, (size_t)len,
+				    &subs[i]) != 0)
+					break;
+				if (subs[i].rec->skip &&
+				    pkg_match(v->value, subs[i].full)) {
+					subs[i].rec->skip = 0;
+					queue[tail++] = i;
+				}
+			}
+		}
+	}
+
+	free(queue);
+	free(subs);
+}
+
+/*
+ * Write a single parsed package, see insert_remote_summary().
+ */
+static void
+import_rec(Sumrepo *repo, struct Sumpkghead *sumpkgs, Sumbatch *b,
+    Sumrec *rec)
+{
+	Sumpkg		*p;
+	const char	*full, *date;
+	int		same = 0;
+
+	/* Both are always complete strings. */
+	if ((full = rec->col[cols.key[SUMKEY_FULLPKGNAME]].value) == NULL)
+		return;
+	date = rec->col[cols.key[SUMKEY_BUILD_DATE]].value;
+
+	if ((p = find_sumpkg(sumpkgs, full)) != NULL) {
+		/* Listed more than once, the first wins. */
+		if (p->seen)
+			return;
+		p->seen = 1;
+		same = (p->build_date == NULL) ? date == NULL :
+		    date != NULL && strcmp(p->build_date, date) == 0;
+		if (same && !force_fetch) {
+			repo->diff.unchanged++;
+			return;
+		}
+		if (!force_fetch)
+			delete_pkg(p->pkg_id);
+	}
+
+	if (insert_pkg(b, rec, repo->url) < 0 &&
+	    (!take_over_pkg(repo, full) ||
+	    insert_pkg(b, rec, repo->url) < 0)) {
+		if (p != NULL)
+			add_sumchange(&repo->diff, SUMDIFF_REMOVED, full);
+		return;
+	}
+
+	if (p == NULL)
+		add_sumchange(&repo->diff, SUMDIFF_ADDED, full);
+	else if (same)
+		repo->diff.unchanged++;
+	else
+		add_sumchange(&repo->diff, SUMDIFF_REBUILT, full);
+}
+
+static void
+load_sumpkgs(const char *url, struct Sumpkghead *sumpkgs)
+{
+	char	query[BUFSIZ];
+	size_t	i;
+
+	for (i = 0; i < REMOTE_PKG_HASH_SIZE; i++)
+		SLIST_INIT(&sumpkgs[i]);
+
+	sqlite3_snprintf(BUFSIZ, query, SELECT_REMOTE_PKG_REPO, url);
+	pkgindb_doquery(query, load_sumpkg, sumpkgs);
+}
+
+static void
+free_sumpkgs(struct Sumpkghead *sumpkgs)
+{
+	Sumpkg	*p;
+	size_t	i;
+
+	for (i = 0; i < REMOTE_PKG_HASH_SIZE; i++) {
+		while (!SLIST_EMPTY(&sumpkgs[i])) {
+			p = SLIST_FIRST(&sumpkgs[i]);
+			SLIST_REMOVE_HEAD(&sumpkgs[i], next);
+			free(p->fullpkgname);
+			free(p->build_date);
+			free(p);
+		}
+	}
+}
+
+/*
+ * Database writer for a remote pkg_summary, inserting records as the parser
+ * produces them.  Returns 0 on success, or -1 if the pipeline failed, in
+ * which case the repository is left as it was, unless its packages were
+ * already removed by empty_remotedb(), which passes in what they were.
+ *
+ * Only packages that were added, removed, or rebuilt (a different BUILD_DATE
+ * for the same FULLPKGNAME) are written, so refreshing a repository where
+ * little has changed is mostly reads.  A forced update replaces every package
+ * instead.  Either way repo->diff records what changed.
+ *
+ * The packages of a filtered repository can only be selected once all of
+ * them are known, so its batches are held until the parser is done, and
+ * anything not selected is then treated as no longer available.
+ */
+static int
+insert_remote_summary(Sumrepo *repo, struct Sumpkghead *sumpkgs)
+{
+	struct Sumpkghead	own[REMOTE_PKG_HASH_SIZE];
+	Sumbatch		*b, **held = NULL;
+	Sumpkg			*p;
+	size_t			i, j, nheld = 0;
+	uint64_t		savepoint;
+	int			rv = 0;
+
+	SLIST_INIT(&repo->diff.changes);
+
+	if (sumpkgs == NULL) {
+		sumpkgs = own;
+		load_sumpkgs(repo->url, sumpkgs);
+	}
+
+	savepoint = pkgindb_savepoint();
+
+	if (force_fetch && sumpkgs == own)
+		delete_remote_tbl(sumsw[REMOTE_SUMMARY], repo->url);
+
+	while ((b = sumq_get(repo->batches)) != NULL) {
+		if (repo->filter != NULL) {
+			held = xrealloc(held, (nheld + 1) * sizeof(Sumbatch *));
+			held[nheld++] = b;
+			continue;
+		}
+		for (i = 0; i < b->nrecs; i++)
+			import_rec(repo, sumpkgs, b, &b->recs[i]);
+		sumq_put(repo->spare, b);
+	}
+
+	if (repo->filter != NULL) {
+		select_subscribed(repo, held, nheld);
+		for (j = 0; j < nheld; j++) {
+			for (i = 0; i < held[j]->nrecs; i++) {
+				if (held[j]->recs[i].skip)
+					repo->diff.filtered++;
+				else
+					import_rec(repo, sumpkgs, held[j],
+					    &held[j]->recs[i]);
+			}
+			free_batch(held[j]);
+		}
+		free(held);
+	}
+
+	/*
+	 * Anything not seen is no longer available from this repository.
+	 */
+	for (i = 0; i < REMOTE_PKG_HASH_SIZE; i++) {
+		while (!SLIST_EMPTY(&sumpkgs[i])) {
+			p = SLIST_FIRST(&sumpkgs[i]);
+			SLIST_REMOVE_HEAD(&sumpkgs[i], next);
+			if (!p->seen) {
+				if (!force_fetch)
+					delete_pkg(p->pkg_id);
+				add_sumchange(&repo->diff, SUMDIFF_REMOVED,
+				    p->fullpkgname);
+			}
+			free(p->fullpkgname);
+			free(p->build_date);
+			free(p);
+		}
+	}
+
+	if (sumview_wait(repo) == SUM_FAILED) {
+		pkgindb_savepoint_rollback(savepoint);
+		free_sumdiff(&repo->diff);
+		rv = -1;
+	}
+
+	pkgindb_savepoint_release(savepoint);
+
+	return rv;
+}
+
+/*
+ * Remove any cached binary packages that have since been rebuilt, they would
+ * only fail the BUILD_DATE check and be downloaded again at install time.
+ */
+static void
+expire_cache(Sumdiff *diff)
+{
+	Sumchange	*c;
+	char		path[BUFSIZ];
+
+	SLIST_FOREACH(c, &diff->changes, next) {
+		if (c->type != SUMDIFF_REBUILT)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s%s", pkgin_cache,
+		    c->fullpkgname, PKG_EXT);
+		(void) unlink(path);
+	}
+}
+
+static void
+delete_remote_tbl(struct Summary sum, char *repo)
+{
+	const char **table;
+
+	/*
+	 * Use results from REMOTE_PKG to delete entries from REMOTE_CONFLICTS
+	 * etc first, then finally remove from REMOTE_PKG.
+	 */
+	for (table = &(sum.pkg) + 1; *table != NULL; ++table) {
+		pkgindb_dovaquery(DELETE_REMOTE, *table, repo);
+	}
+	pkgindb_dovaquery(DELETE_REMOTE_PKG_REPO, repo);
+}
+
+/*
+ * Record the packages that each installed package is required by.  The
+ * DEPENDS of local packages are the @pkgdep lines of their +CONTENTS, read
+ * when each package was imported, and each pattern is resolved against the
+ * local package list, looking only at the packages of its PKGBASE if it has
+ * one.  A package requiring another through more than one pattern is only
+ * recorded once.
+ *
+ * Only the entries that the last sync could have changed, as recorded in
+ * local_changed, are removed and recorded again.
+ */
+static void
+insert_local_required_by(void)
+{
+	sqlite3_stmt	*deps, *reqd_by;
+	Pkglist		*lpkg, **reqd = NULL;
+	const char	*full, *pattern, *pkgbase;
+	int64_t		pkgid, lastid = -1;
+	size_t		i, nreqd = 0, reqdsz = 0;
+
+	pkgindb_doquery(DELETE_LOCAL_REQUIRED_BY_CHANGED, NULL, NULL);
+
+	deps = pkgindb_stmt_prepare(SELECT_LOCAL_DEPENDS_CHANGED);
+	reqd_by = pkgindb_stmt_prepare(INSERT_REQUIRED_BY);
+
+	while (sqlite3_step(deps) == SQLITE_ROW) {
+		pkgid = sqlite3_column_int64(deps, 0);
+		full = (const char *)sqlite3_column_text(deps, 1);
+		pattern = (const char *)sqlite3_column_text(deps, 2);
+		pkgbase = (const char *)sqlite3_column_text(deps, 3);
+
+		if (pkgid != lastid) {
+			lastid = pkgid;
+			nreqd = 0;
 		}
-		return;
+
+		if ((lpkg = find_local_pkg(pattern, pkgbase)) == NULL) {
+			warnx("Dependency %s of %s unresolved", pattern, full);
+			continue;
+		}
+
+		for (i = 0; i < nreqd; i++) {
+			if (reqd[i] == lpkg)
+				break;
+		}
+		if (i < nreqd)
+			continue;
+		if (nreqd == reqdsz) {
+			reqdsz = reqdsz ? reqdsz * 2 : 16;
+			reqd = xrealloc(reqd, reqdsz * sizeof(Pkglist *));
+		}
+		reqd[nreqd++] = lpkg;
+
+		if (sqlite3_bind_text(reqd_by, 1, lpkg->full, -1,
+		    SQLITE_STATIC) != SQLITE_OK ||
+		    sqlite3_bind_text(reqd_by, 2, full, -1, SQLITE_STATIC)
+		    != SQLITE_OK)
+			errx(EXIT_FAILURE, "Failed to bind %s", full);
+		pkgindb_stmt_exec(reqd_by);
 	}
 
-	if (strncmp(line, "CONFLICTS=", 10) == 0) {
-		insert_pattern(stmts.conflicts, pkgid, val);
-		return;
+	pkgindb_stmt_finalize(reqd_by);
+	pkgindb_stmt_finalize(deps);
+	free(reqd);
+}
+
+/*
+ * Installed packages found in the pkgdb, along with the modification time of
+ * their +CONTENTS, which is written whenever a package is (re)installed, and
+ * of +INSTALLED_INFO, which holds the automatic flag.
+ */
+typedef struct Localpkg {
+	char		*fullpkgname;
+	int64_t		mtime;
+	int64_t		ntime;
+	int64_t		info_mtime;	/* -1 without +INSTALLED_INFO */
+	int64_t		info_ntime;
+	int		seen;		/* +CONTENTS is unchanged */
+	int		newinfo;	/* The automatic flag is to be read */
+	int		automatic;
+	char		*text;		/* Its pkg_summary entry once read */
+	size_t		len;
+	size_t		size;
+	SLIST_ENTRY(Localpkg) next;
+} Localpkg;
+
+SLIST_HEAD(Localpkghead, Localpkg);
+
+typedef struct Localsync {
+	struct Localpkghead	pkgs[LOCAL_PKG_HASH_SIZE];
+	char			**stale;
+	size_t			nstale;
+} Localsync;
+
+static int
+scan_localpkg(const char *pkgname, void *cookie)
+{
+	Localsync	*sync = cookie;
+	struct stat	st;
+	Localpkg	*p;
+	char		*path;
+	int		rv;
+
+	/* Not a package, or one that pkg_info would not be able to read. */
+	path = pkgdb_pkg_file(pkgname, CONTENTS_FNAME);
+	rv = stat(path, &st);
+	free(path);
+	if (rv < 0)
+		return 0;
+
+	p = xmalloc(sizeof(Localpkg));
+	p->fullpkgname = xstrdup(pkgname);
+	p->mtime = (int64_t)st.st_mtime;
+	p->ntime = (int64_t)st.pkgin_nanotime;
+
+	path = pkgdb_pkg_file(pkgname, INSTALLED_INFO_FNAME);
+	if (stat(path, &st) == 0) {
+		p->info_mtime = (int64_t)st.st_mtime;
+		p->info_ntime = (int64_t)st.pkgin_nanotime;
+	} else
+		p->info_mtime = p->info_ntime = -1;
+	free(path);
+
+	p->seen = 0;
+	p->newinfo = 1;
+	p->automatic = 0;
+	p->text = NULL;
+	p->len = p->size = 0;
+	SLIST_INSERT_HEAD(&sync->pkgs[pkg_hash_entry(pkgname,
+	    LOCAL_PKG_HASH_SIZE)], p, next);
+
+	return 0;
+}
+
+/*
+ * Compare a package recorded in local_pkgdb with the pkgdb.  Those unchanged
+ * are marked as seen, any that were removed or changed are stale.  The
+ * automatic flag of a package that is seen is only read again if its
+ * +INSTALLED_INFO changed.
+ */
+static int
+check_localpkg(void *param, int argc, char **argv, char **colname)
+{
+	Localsync	*sync = param;
+	Localpkg	*p;
+
+	if (argv == NULL || argv[0] == NULL)
+		return PDB_ERR;
+
+	SLIST_FOREACH(p, &sync->pkgs[pkg_hash_entry(argv[0],
+	    LOCAL_PKG_HASH_SIZE)], next) {
+		if (strcmp(p->fullpkgname, argv[0]) == 0)
+			break;
 	}
 
-	if (strncmp(line, "DEPENDS=", 8) == 0) {
-		insert_pattern(stmts.depends, pkgid, val);
-		return;
+	if (p != NULL && argv[1] != NULL && argv[2] != NULL &&
+	    strtoll(argv[1], NULL, 10) == p->mtime &&
+	    strtoll(argv[2], NULL, 10) == p->ntime) {
+		p->seen = 1;
+		p->newinfo = (argv[3] == NULL || argv[4] == NULL ||
+		    strtoll(argv[3], NULL, 10) != p->info_mtime ||
+		    strtoll(argv[4], NULL, 10) != p->info_ntime);
+		return PDB_OK;
 	}
 
-	if (strncmp(line, "PROVIDES=", 9) == 0) {
-		insert_value(stmts.provides, pkgid, val);
-		return;
+	sync->stale = xrealloc(sync->stale,
+	    (sync->nstale + 1) * sizeof(char *));
+	sync->stale[sync->nstale++] = xstrdup(argv[0]);
+
+	return PDB_OK;
+}
+
+/*
+ * The +BUILD_INFO variables that pkg_info -X includes in each entry.
+ */
+static const char *const local_build_vars[] = {
+	"PKGPATH", "CATEGORIES", "PROVIDES", "REQUIRES", "PKG_OPTIONS",
+	"OPSYS", "OS_VERSION", "MACHINE_ARCH", "LICENSE", "HOMEPAGE",
+	"PKGTOOLS_VERSION", "BUILD_DATE", "PREV_PKGPATH", "SUPERSEDES", NULL
+};
+
+/*
+ * Threads reading the pkgdb, each taking the next package in turn.
+ */
+#define LOCALREAD_THREADS	8
+
+typedef struct Localread {
+	pthread_mutex_t	lock;
+	Localpkg	**pkgs;
+	size_t		npkgs;
+	size_t		next;
+} Localread;
+
+/*
+ * Return the contents of a pkgdb file of a package, or NULL if it cannot be
+ * read.
+ */
+static char *
+read_pkgdb_file(const char *pkgname, const char *fname)
+{
+	struct stat	st;
+	char		*path, *buf;
+	size_t		len = 0, size;
+	ssize_t		n;
+	int		fd;
+
+	path = pkgdb_pkg_file(pkgname, fname);
+	fd = open(path, O_RDONLY);
+	free(path);
+	if (fd < 0)
+		return NULL;
+
+	size = (fstat(fd, &st) == 0 && st.st_size > 0) ?
+	    (size_t)st.st_size + 1 : BUFSIZ;
+	buf = xmalloc(size);
+
+	while ((n = read(fd, buf + len, size - len - 1)) > 0) {
+		len += (size_t)n;
+		if (len == size - 1) {
+			size *= 2;
+			buf = xrealloc(buf, size);
+		}
+	}
+	(void) close(fd);
+
+	if (n < 0) {
+		free(buf);
+		return NULL;
+	}
+	buf[len] = '\0';
+
+	return buf;
+}
+
+static void
+local_append(Localpkg *p, const char *s, size_t len)
+{
+	if (p->len + len > p->size) {
+		while (p->len + len > p->size)
+			p->size = p->size ? p->size * 2 : BUFSIZ;
+		p->text = xrealloc(p->text, p->size);
+	}
+	memcpy(p->text + p->len, s, len);
+	p->len += len;
+}
+
+static void
+local_add_line(Localpkg *p, const char *var, const char *value, size_t len)
+{
+	local_append(p, var, strlen(var));
+	local_append(p, "=", 1);
+	local_append(p, value, len);
+	local_append(p, "\n", 1);
+}
+
+/*
+ * Add each line of a pkgdb file as an entry for the variable, as pkg_info
+ * does for +COMMENT and +DESC.
+ */
+static void
+local_add_lines(Localpkg *p, const char *var, const char *value)
+{
+	const char *eol;
+
+	while ((eol = strchr(value, '\n')) != NULL) {
+		local_add_line(p, var, value, (size_t)(eol - value));
+		value = eol + 1;
 	}
+	if (*value != '\0')
+		local_add_line(p, var, value, strlen(value));
+}
+
+/*
+ * Read an installed package from its pkgdb files into the same pkg_summary
+ * entry that pkg_info -X would print for it.  Only the @name, @pkgdep and
+ * @pkgcfl lines of +CONTENTS are needed, and +BUILD_INFO is filtered down to
+ * the variables pkg_info includes.
+ */
+static void
+read_localpkg(Localpkg *p)
+{
+	const char	*line, *arg, *end, *const *var;
+	char		*buf, *eol;
+	size_t		len, vlen;
 
-	if (strncmp(line, "REQUIRES=", 9) == 0) {
-		insert_value(stmts.requires, pkgid, val);
+	if ((buf = read_pkgdb_file(p->fullpkgname, CONTENTS_FNAME)) == NULL) {
+		warnx("Cannot read %s of package %s", CONTENTS_FNAME,
+		    p->fullpkgname);
 		return;
 	}
+	for (line = buf; *line != '\0'; line = eol + 1) {
+		if ((eol = strchr(line, '\n')) == NULL)
+			eol = (char *)line + strlen(line);
+		if (*line == '@') {
+			for (end = eol; end > line &&
+			    isspace((unsigned char)end[-1]); end--)
+				;
+			for (arg = line; arg < end &&
+			    !isspace((unsigned char)*arg); arg++)
+				;
+			len = (size_t)(arg - line);
+			while (arg < end && isspace((unsigned char)*arg))
+				arg++;
+			if (len == 5 && strncmp(line, "@name", len) == 0)
+				local_add_line(p, "PKGNAME", arg,
+				    (size_t)(end - arg));
+			else if (len == 7 && strncmp(line, "@pkgdep", len) == 0)
+				local_add_line(p, "DEPENDS", arg,
+				    (size_t)(end - arg));
+			else if (len == 7 && strncmp(line, "@pkgcfl", len) == 0)
+				local_add_line(p, "CONFLICTS", arg,
+				    (size_t)(end - arg));
+		}
+		if (*eol == '\0')
+			break;
+	}
+	free(buf);
 
-	if (strncmp(line, "SUPERSEDES=", 11) == 0) {
-		/*
-		 * Only remote SUPERSEDES are supported.
-		 */
-		if (sum.type == REMOTE_SUMMARY)
-			insert_pattern(stmts.supersedes, pkgid, val);
+	if ((buf = read_pkgdb_file(p->fullpkgname, COMMENT_FNAME)) != NULL) {
+		local_add_lines(p, "COMMENT", buf);
+		free(buf);
+	}
+	if ((buf = read_pkgdb_file(p->fullpkgname, SIZE_PKG_FNAME)) != NULL) {
+		local_add_lines(p, "SIZE_PKG", buf);
+		free(buf);
+	}
+
+	if ((buf = read_pkgdb_file(p->fullpkgname, BUILD_INFO_FNAME)) != NULL) {
+		for (line = buf; *line != '\0'; line = eol + 1) {
+			if ((eol = strchr(line, '\n')) == NULL)
+				eol = (char *)line + strlen(line);
+			for (var = local_build_vars; *var != NULL; var++) {
+				vlen = strlen(*var);
+				if (strncmp(line, *var, vlen) == 0 &&
+				    line[vlen] == '=') {
+					local_append(p, line,
+					    (size_t)(eol - line));
+					local_append(p, "\n", 1);
+					break;
+				}
+			}
+			if (*eol == '\0')
+				break;
+		}
+		free(buf);
+	} else
+		warnx("Build information missing for %s", p->fullpkgname);
+
+	if ((buf = read_pkgdb_file(p->fullpkgname, DESC_FNAME)) != NULL) {
+		local_add_lines(p, "DESCRIPTION", buf);
+		free(buf);
+	}
+
+	local_append(p, "\n", 1);
+}
+
+/*
+ * Read the automatic flag of a package, as is_automatic_installed() does.
+ */
+static void
+read_automatic(Localpkg *p)
+{
+	char *buf, *value;
+
+	p->automatic = 0;
+	if (p->info_mtime < 0 ||
+	    (buf = read_pkgdb_file(p->fullpkgname, INSTALLED_INFO_FNAME))
+	    == NULL)
 		return;
+
+	if ((value = var_get_memory(buf, AUTOMATIC_VARNAME)) != NULL) {
+		p->automatic = (strcasecmp(value, "yes") == 0);
+		free(value);
+	}
+	free(buf);
+}
+
+static void *
+read_localpkg_thread(void *arg)
+{
+	Localread	*r = arg;
+	size_t		i;
+
+	for (;;) {
+		pthread_mutex_lock(&r->lock);
+		i = r->next++;
+		pthread_mutex_unlock(&r->lock);
+		if (i >= r->npkgs)
+			break;
+		if (!r->pkgs[i]->seen)
+			read_localpkg(r->pkgs[i]);
+		if (r->pkgs[i]->newinfo)
+			read_automatic(r->pkgs[i]);
+	}
+
+	return NULL;
+}
+
+/*
+ * Read the given packages directly from the pkgdb, with a thread per online
+ * CPU, and import those that are not yet seen in a single batch.
+ */
+static void
+read_localpkgs(Localpkg **pkgs, size_t npkgs)
+{
+	Localread	r;
+	Sumbatch	*b;
+	pthread_t	tids[LOCALREAD_THREADS];
+	long		ncpu;
+	size_t		i, len;
+	int		n, nthreads = 0;
+
+	r.pkgs = pkgs;
+	r.npkgs = npkgs;
+	r.next = 0;
+	pthread_mutex_init(&r.lock, NULL);
+
+	/* This thread reads too. */
+	if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) > LOCALREAD_THREADS)
+		ncpu = LOCALREAD_THREADS;
+	for (n = 1; n < ncpu && (size_t)n < npkgs; n++) {
+		if (pthread_create(&tids[nthreads], NULL, read_localpkg_thread,
+		    &r) != 0)
+			break;
+		nthreads++;
+	}
+	(void) read_localpkg_thread(&r);
+	for (n = 0; n < nthreads; n++)
+		pthread_join(tids[n], NULL);
+	pthread_mutex_destroy(&r.lock);
+
+	b = xcalloc(1, sizeof(Sumbatch));
+	for (i = 0, len = 0; i < npkgs; i++)
+		len += pkgs[i]->len;
+	b->size = len + 1;
+	b->text = xmalloc(b->size);
+	for (i = 0; i < npkgs; i++) {
+		if (pkgs[i]->text == NULL)
+			continue;
+		memcpy(b->text + b->len, pkgs[i]->text, pkgs[i]->len);
+		b->len += pkgs[i]->len;
+		XFREE(pkgs[i]->text);
+	}
+	b->text[b->len] = '\0';
+
+	if (b->len > 0)
+		insert_local_summary(b);
+	else
+		free_batch(b);
+}
+
+/*
+ * Bring the local package tables in line with the pkgdb.  Only packages that
+ * were installed or reinstalled since the last run are read from the pkgdb,
+ * those no longer installed are removed, and the rest are left alone apart
+ * from their automatic flag if that has changed.  Returns the number of
+ * packages that were read or removed.
+ */
+static size_t
+sync_localdb(int verbose)
+{
+	Localsync	sync;
+	Localpkg	*p, **todo = NULL;
+	size_t		n, ntodo = 0, nadded = 0, changes;
+	int		i;
+
+	for (i = 0; i < LOCAL_PKG_HASH_SIZE; i++)
+		SLIST_INIT(&sync.pkgs[i]);
+	sync.stale = NULL;
+	sync.nstale = 0;
+
+	pkgindb_doquery(CREATE_LOCAL_CHANGED, NULL, NULL);
+
+	if (iterate_pkg_db(scan_localpkg, &sync) == -1)
+		errx(EXIT_FAILURE, "cannot iterate pkgdb");
+
+	pkgindb_doquery(SELECT_LOCAL_PKGDB, check_localpkg, &sync);
+
+	for (i = 0; i < LOCAL_PKG_HASH_SIZE; i++) {
+		SLIST_FOREACH(p, &sync.pkgs[i], next) {
+			if (p->seen && !p->newinfo)
+				continue;
+			if (!p->seen)
+				nadded++;
+			todo = xrealloc(todo, (ntodo + 1) * sizeof(*todo));
+			todo[ntodo++] = p;
+		}
 	}
 
 	/*
-	 * Currently we ignore DESCRIPTION entries as they are multi-line
-	 * which aren't supported.
+	 * Any LOCAL_PKG entries without a local_pkgdb one, such as after an
+	 * upgrade of the database, are removed along with the stale ones.
 	 */
-	if (strncmp(line, "DESCRIPTION=", 12) == 0)
-		return;
+	for (n = 0; n < sync.nstale; n++) {
+		pkgindb_dovaquery(DELETE_LOCAL_PKGDB, sync.stale[n]);
+		free(sync.stale[n]);
+	}
+	free(sync.stale);
+
+	if ((changes = nadded + sync.nstale) > 0) {
+		pkgindb_doquery(INSERT_LOCAL_CHANGED, NULL, NULL);
+		pkgindb_doquery(DELETE_LOCAL_STALE, NULL, NULL);
+	}
+
+	if (ntodo > 0) {
+		if (verbose && nadded > 0)
+			printf(MSG_READING_LOCAL_SUMMARY);
+		read_localpkgs(todo, ntodo);
+		if (nadded > 0)
+			pkgindb_doquery(INSERT_LOCAL_CHANGED, NULL, NULL);
+		for (n = 0; n < ntodo; n++) {
+			/* Not recorded if it could not be read. */
+			if (!todo[n]->seen && todo[n]->len == 0)
+				continue;
+			pkgindb_dovaquery(INSERT_LOCAL_PKGDB,
+			    todo[n]->fullpkgname, (long long)todo[n]->mtime,
+			    (long long)todo[n]->ntime,
+			    (long long)todo[n]->info_mtime,
+			    (long long)todo[n]->info_ntime,
+			    todo[n]->automatic);
+		}
+		pkgindb_doquery(UPDATE_LOCAL_KEEP, NULL, NULL);
+	}
+	free(todo);
+
+	for (i = 0; i < LOCAL_PKG_HASH_SIZE; i++) {
+		while (!SLIST_EMPTY(&sync.pkgs[i])) {
+			p = SLIST_FIRST(&sync.pkgs[i]);
+			SLIST_REMOVE_HEAD(&sync.pkgs[i], next);
+			free(p->fullpkgname);
+			free(p);
+		}
+	}
+
+	return changes;
+}
+
+static void
+update_localdb(int verbose)
+{
+	struct stat st;
+	size_t changes;
+
+	/*
+	 * Start a write transaction, excluding other writers until committed.
+	 * BEGIN IMMEDIATE would also take the write lock of the remote
+	 * catalog, which other roots may share, so it is only taken on
+	 * pkgin.db by an empty write to it.
+	 */
+	if (pkgindb_doquery("BEGIN; DELETE FROM main.PKGDB WHERE 0;", NULL,
+	    NULL))
+		errx(EXIT_FAILURE, "failed to begin immediate transaction");
+
+	/*
+	 * Only look for changes if forced or if the pkgdb changed, and when
+	 * forced start again from an empty table so that everything is read.
+	 */
+	if (!pkg_db_mtime(&st) && !force_fetch)
+		goto out;
+
+	if (force_fetch)
+		pkgindb_doquery(DELETE_LOCAL, NULL, NULL);
+
+	changes = sync_localdb(verbose);
+	pkg_db_update_mtime(&st);
+
+	/*
+	 * Reread the local package list.  This updates l_plisthead, which
+	 * dependencies are then resolved against.
+	 */
+	free_local_pkglist();
+	init_local_pkglist();
+
+	if (changes > 0) {
+		if (verbose)
+			printf(MSG_PROCESSING_LOCAL_SUMMARY);
+		insert_local_required_by();
+	}
+
+out:
+	if (pkgindb_doquery("COMMIT;", NULL, NULL))
+		errx(EXIT_FAILURE, "failed to commit transaction");
+}
+
+/*
+ * Whether the remote catalog is kept in PKGIN_REMOTE_DBDIR, where it may be
+ * shared with other roots that have their own repositories.conf.
+ */
+static int
+remote_shared(void)
+{
+	return strcmp(pkgin_remotedir, pkgin_dbdir) != 0;
+}
+
+/*
+ * Check to see if database repositories are still configured.  If not, delete
+ * and force a refresh.
+ */
+static int
+pdb_delete_remote(void *param, int argc, char **argv, char **colname)
+{
+	int i;
+
+	if (argv == NULL)
+		return PDB_ERR;
+
+	for (i = 0; pkg_repos[i] != NULL; i++) {
+		if (strcmp(pkg_repos[i], argv[0]) == 0)
+			return PDB_OK;
+	}
+
+	/* Another root may have recorded it since chk_repo_list(). */
+	if (remote_shared() && !force_fetch)
+		errx(EXIT_FAILURE, MSG_REPO_NOT_SHARED, argv[0],
+		    pkgin_remotedb);
+
+	printf(MSG_CLEANING_DB_FROM_REPO, argv[0]);
+	delete_remote_tbl(sumsw[REMOTE_SUMMARY], argv[0]);
+	remove_saved_summaries(argv[0], NULL);
+	pkgindb_dovaquery(DELETE_REPO_URL, argv[0]);
+
+	force_fetch = 1;
+
+	return PDB_OK;
+}
+
+/*
+ * Remember which suffix a repository was found with if we had to look for it.
+ */
+static void
+record_sumext(Sumrepo *repo, time_t now)
+{
+	if (repo->probe)
+		pkgindb_dovaquery(UPDATE_REPO_EXT, repo->ext, (long long)now,
+		    repo->url);
+}
+
+/*
+ * Start the new catalog, which only holds the configured repositories.
+ */
+static void
+begin_remotedb(void)
+{
+	pkgindb_remote_begin();
+	pkgindb_doquery(SELECT_REPO_URLS, pdb_delete_remote, NULL);
+	repo_record(pkg_repos);
+}
 
-	/*
-	 * Skip empty values like LICENSE=
-	 */
-	if (*val == '\0')
-		return;
+/*
+ * A bulk load imports every repository again, so it starts from an empty
+ * catalog.  Otherwise each package that is also listed by a repository
+ * imported later would have to be deleted from it by take_over_pkg(), with
+ * a full scan of every table while the PKG_ID indexes are dropped.  What
+ * each repository held is loaded first so that what changed is still known.
+ */
+static void
+empty_remotedb(Sumrepo *repos, int count, struct Sumpkghead *sumpkgs)
+{
+	const char * const	*table;
+	int			i;
 
-	/*
-	 * Handle remaining columns.
-	 */
-	for (i = 0; i < cols.num; i++) {
-		if (strncmp(line, cols.name[i], cols.len[i]) == 0 &&
-		    line[cols.len[i]] == '=') {
-			/* Split PKGNAME into parts */
-			if (strncmp(cols.name[i], "PKGNAME", 7) == 0) {
-				/* some rare packages have no version */
-				if (!exact_pkgfmt(val)) {
-					snprintf(buf, BUFSIZ, "%s%s", val,
-					    "-0.0");
-					val = buf;
-				}
-				add_to_slist("FULLPKGNAME", val);
-
-				/* split PKGNAME and VERSION */
-				v = strrchr(val, '-');
-				if (v != NULL)
-					*v++ = '\0';
-				add_to_slist("PKGNAME", val);
-				add_to_slist("PKGVERS", v);
-			} else
-				add_to_slist(cols.name[i], val);
-			break;
-		}
-	}
+	for (i = 0; i < count; i++)
+		load_sumpkgs(repos[i].url, &sumpkgs[i * REMOTE_PKG_HASH_SIZE]);
+
+	for (table = &sumsw[REMOTE_SUMMARY].pkg; *table != NULL; table++)
+		pkgindb_dovaquery(DELETE_REMOTE_ALL, *table);
 }
 
 /*
- * Stream the local pkg_info information into the local summary.
+ * Update all configured repositories.  Each repository is fetched, decoded
+ * and parsed by its own threads, so a slow or unavailable mirror does not
+ * hold up any of the others, while this thread is the only database writer
+ * and imports each repository in turn as records become available.
  */
 static void
-insert_local_summary(FILE *fp)
+update_remotedb(int verbose)
 {
-	static int	pkgid = 1;
-	char		buf[BUFSIZ];
-	uint64_t	savepoint;
+	Sumrepo			*repos;
+	Sumbatch		*b;
+	struct Sumpkghead	*sumpkgs = NULL;
+	time_t			now, probe_after;
+	int			count, failed = 0, i, j;
+	uint8_t			cleaned = 0, bulk;
+	char			*p, *path, npkgs[32];
 
-	if (fp == NULL) {
-		pkgindb_close();
-		errx(EXIT_FAILURE, "Couldn't read local pkg_info");
-	}
-
-	/* record columns names to cols, resetting any previous import */
-	freecols();
-	sqlite3_snprintf(BUFSIZ, buf, "PRAGMA table_info(%w);",
-	    sumsw[LOCAL_SUMMARY].pkg);
-	pkgindb_doquery(buf, colnames, NULL);
+	for (count = 0; pkg_repos[count] != NULL; count++)
+		;
 
-	SLIST_INIT(&inserthead);
+	now = time(NULL);
+	probe_after = (time_t)SUM_PROBE_DAYS * 86400;
+	if ((p = getenv("PKGIN_PROBE_DAYS")) != NULL)
+		probe_after = (time_t)strtol(p, NULL, 10) * 86400;
 
-	prepare_stmts(sumsw[LOCAL_SUMMARY]);
+	repos = xcalloc((size_t)count, sizeof(Sumrepo));
 
-	savepoint = pkgindb_savepoint();
+	pkgindb_remote_lock();
 
-	while (fgets(buf, BUFSIZ, fp) != NULL) {
+	/*
+	 * Look up the current mtimes and columns first, the fetch threads
+	 * must not touch the database.
+	 */
+	for (i = 0; i < count; i++)
+		repos[i].url = pkg_repos[i];
+	load_subscriptions(repos, count);
+
+	for (i = 0; i < count; i++) {
+		repos[i].state = SUM_WAITING;
+		repos[i].size = -1;
+		pkg_sum_repo(&repos[i]);
 		/*
-		 * End of current package entry, commit and reset.
+		 * A repository whose subscription changed has to be imported
+		 * again to add or remove the packages it now covers.
 		 */
-		if (*buf == '\n') {
-			insert_pkg(pkgid++);
-			free_insertlist();
-			continue;
+		if (force_fetch || (repos[i].filter == NULL ?
+		    repos[i].dbfilter != NULL : repos[i].dbfilter == NULL ||
+		    strcmp(repos[i].filter, repos[i].dbfilter) != 0)) {
+			repos[i].mtime = 0;
+			repos[i].dbsize = -1;
 		}
-		trimcr(buf);
-		parse_entry(sumsw[LOCAL_SUMMARY], pkgid, buf);
-	}
-
-	pkgindb_savepoint_release(savepoint);
+		XFREE(repos[i].dbfilter);
 
-	finalize_stmts(sumsw[LOCAL_SUMMARY]);
-}
+		/*
+		 * Use the suffix found last time, unless it is one we no
+		 * longer support or it is time to look for a better one.
+		 */
+		for (j = 0; repos[i].dbext != NULL && sumexts[j] != NULL; j++) {
+			if (strcmp(sumexts[j], repos[i].dbext) == 0) {
+				repos[i].ext = sumexts[j];
+				break;
+			}
+		}
+		XFREE(repos[i].dbext);
+		repos[i].probe = (repos[i].ext == NULL || force_fetch ||
+		    now - repos[i].probed >= probe_after);
 
-/*
- * Stream a remote pkg_summary via libarchive into the local database.
- */
-static void
-insert_remote_summary(struct archive *a, char *cur_repo)
-{
-	static int	pkgid = 1;
-	size_t		buflen, offset;
-	ssize_t		r;
-	char		*buf, *pe, *pi, *npi;
-	uint64_t	savepoint;
+		/* Nothing to compare against, see saved_summary(). */
+		if (repos[i].mtime == 0 && repos[i].dbsize < 0)
+			find_saved_summary(&repos[i]);
 
-	if (a == NULL) {
-		pkgindb_close();
-		errx(EXIT_FAILURE, "Couldn't read pkg_summary");
+		repos[i].chunks = sumq_new();
+		repos[i].batches = sumq_new();
+		repos[i].spare = sumq_new();
 	}
 
 	/*
-	 * Initial archive buffer, we grow if required.  Try to hit the
-	 * sweet spot between memory usage and CPU time required to move
-	 * the buffer back to the beginning each time.
+	 * When forced, or with nothing yet to compare against, every
+	 * repository is imported in full and can be bulk loaded.
 	 */
-	buflen = 32768;
-	buf = xmalloc(buflen + 1);
-
-	/* record columns names to cols, resetting any previous import */
-	freecols();
-	sqlite3_snprintf(buflen, buf, "PRAGMA table_info(%w);",
-	    sumsw[REMOTE_SUMMARY].pkg);
-	pkgindb_doquery(buf, colnames, NULL);
+	npkgs[0] = '\0';
+	pkgindb_doquery(COUNT_REMOTE_PKG, pdb_get_value, npkgs);
+	bulk = force_fetch || strcmp(npkgs, "0") == 0;
+	if (bulk)
+		sumpkgs = xcalloc((size_t)count * REMOTE_PKG_HASH_SIZE,
+		    sizeof(struct Sumpkghead));
+
+	loadcols(sumsw[REMOTE_SUMMARY]);
+	prepare_stmts(sumsw[REMOTE_SUMMARY]);
 
-	SLIST_INIT(&inserthead);
+	if (access(pkgin_sumdir, F_OK) != 0)
+		(void) mkdir(pkgin_sumdir, 0755);
 
-	prepare_stmts(sumsw[REMOTE_SUMMARY]);
+	sumview_start(repos, count, verbose);
 
-	savepoint = pkgindb_savepoint();
+	for (i = 0; i < count; i++) {
+		if (pthread_create(&repos[i].tid, NULL, fetch_summary,
+		    &repos[i]) != 0)
+			err(EXIT_FAILURE, "Cannot create fetch thread");
+	}
 
 	/*
-	 * Main loop.  Read in archive, split into package records and parse
-	 * each entry, then insert packge.  If we are in the middle of a
-	 * package, copy it to the beginning and read the remainder.
+	 * Import in the configured order rather than as repositories finish.
+	 * When the same package is available from more than one repository
+	 * the first one listed wins (see take_over_pkg()), and in this order
+	 * it is usually already there when the others are imported.  The
+	 * remaining repositories continue to download, and decode until their
+	 * queues are full, in the meantime.
 	 */
-	offset = 0;
-	for (;;) {
-		r = archive_read_data(a, buf + offset, buflen - offset);
-
-		/* We're done with reading from the archive. */
-		if (r <= 0)
+	for (i = 0; i < count; i++) {
+		switch (sumview_wait(&repos[i])) {
+		case SUM_DECODING:
 			break;
-
-		pi = buf;
-		buf[(size_t)r + offset] = '\0';
-
-		/*
-		 * Highly unlikely, but if we can't fit a single pkg_info entry
-		 * into our reasonably sized buffer, then we have no choice but
-		 * to increase the buffer size.
-		 */
-		if (strstr(pi, "\n\n") == NULL) {
-			offset = buflen;
-			buflen *= 2;
-			buf = xrealloc(buf, buflen + 1);
+		case SUM_UPTODATE:
+			continue;
+		case SUM_FAILED:
+			failed++;
+			/* FALLTHROUGH */
+		default:
 			continue;
 		}
 
 		/*
-		 * Packages are delimited by an empty line, we split the buffer
-		 * by package with pi pointing to the beginning and npi the end.
+		 * Build the new catalog alongside the current one, which is
+		 * only replaced once everything has been imported.
 		 */
-		for (;;) {
-			/*
-			 * No remaining complete package entries, move the
-			 * leftover to the beginning and start again.
-			 */
-			if ((npi = strstr(pi, "\n\n")) == NULL) {
-				offset = strlen(pi);
-				memmove(buf, pi, offset + 1);
-				break;
+		if (!cleaned) {
+			begin_remotedb();
+			if (bulk) {
+				pkgindb_bulk_begin();
+				empty_remotedb(repos, count, sumpkgs);
 			}
+			cleaned = 1;
+		}
+
+		sumview_set(&repos[i], SUM_IMPORTING);
 
-			*npi = '\0';
-			npi += 2;
+		/* replace remote* for this repository */
+		if (insert_remote_summary(&repos[i], bulk ?
+		    &sumpkgs[i * REMOTE_PKG_HASH_SIZE] : NULL) != 0) {
+			failed++;
+			continue;
+		}
 
-			/*
-			 * Handle each KEY=value pkg_info entry.
-			 */
-			while ((pe = strsep(&pi, "\n")) != NULL)
-				parse_entry(sumsw[REMOTE_SUMMARY], pkgid, pe);
+		/* record the validators for the next conditional fetch */
+		pkgindb_dovaquery(UPDATE_REPO_SUM, (long long)repos[i].mtime,
+		    (long long)repos[i].size, repos[i].url);
+		pkgindb_dovaquery(UPDATE_REPO_FILTER, repos[i].filter,
+		    repos[i].url);
+		record_sumext(&repos[i], now);
 
-			/* Add REPOSITORY information */
-			add_to_slist("REPOSITORY", cur_repo);
+		expire_cache(&repos[i].diff);
 
-			/*
-			 * At this point we should have a fully populated slist
-			 * and all the data we need to construct the INSERT.
-			 */
-			insert_pkg(pkgid++);
+		sumview_set(&repos[i], SUM_DONE);
+	}
 
-			/* Set up for next pkg_info */
-			free_insertlist();
-			pi = npi;
+	/*
+	 * Repositories that failed have nothing left in an emptied catalog,
+	 * so must not be considered up-to-date next time.
+	 */
+	if (bulk && cleaned) {
+		for (i = 0; i < count; i++) {
+			if (sumview_wait(&repos[i]) == SUM_FAILED)
+				pkgindb_dovaquery(RESET_REPO_SUM,
+				    repos[i].url);
 		}
+		pkgindb_bulk_end();
 	}
 
-	XFREE(buf);
+	/*
+	 * Remember the suffixes that had to be looked for in repositories that
+	 * were up-to-date as well, in a new catalog even if nothing else
+	 * needed one as the current one is not written to.
+	 */
+	for (i = 0; i < count; i++) {
+		if (sumview_wait(&repos[i]) != SUM_UPTODATE || !repos[i].probe)
+			continue;
+		if (!cleaned) {
+			begin_remotedb();
+			cleaned = 1;
+		}
+		record_sumext(&repos[i], now);
+	}
 
-	if (r != ARCHIVE_OK) {
-		pkgindb_savepoint_rollback(savepoint);
-		errx(EXIT_FAILURE, "Short read of pkg_summary: %s",
-		    archive_error_string(a));
+	for (i = 0; i < count; i++) {
+		pthread_join(repos[i].tid, NULL);
+		sumq_free(repos[i].chunks);
+		sumq_free(repos[i].batches);
+		sumq_close(repos[i].spare);
+		while ((b = sumq_get(repos[i].spare)) != NULL)
+			free_batch(b);
+		sumq_free(repos[i].spare);
+		free_sumdiff(&repos[i].diff);
+		release_summary(&repos[i]);
+		XFREE(repos[i].saved);
+		if (sumpkgs != NULL)
+			free_sumpkgs(&sumpkgs[i * REMOTE_PKG_HASH_SIZE]);
 	}
+	XFREE(sumpkgs);
 
-	pkgindb_savepoint_release(savepoint);
+	sumview_stop();
 
-	finalize_stmts(sumsw[REMOTE_SUMMARY]);
+	/* The view shows whether each repository is filtered. */
+	for (i = 0; i < count; i++)
+		free_subscription(&repos[i]);
 
-#if ARCHIVE_VERSION_NUMBER < 3000000
-	archive_read_finish(a);
-#else
-	archive_read_free(a);
-#endif
-}
+	finalize_stmts();
 
-static void
-delete_remote_tbl(struct Summary sum, char *repo)
-{
-	const char **table;
+	if (cleaned)
+		pkgindb_remote_commit();
+	else
+		pkgindb_remote_unlock();
+
+	XFREE(repos);
 
 	/*
-	 * Use results from REMOTE_PKG to delete entries from REMOTE_CONFLICTS
-	 * etc first, then finally remove from REMOTE_PKG.
+	 * Publish the catalog whenever it has changed, or if it was not there
+	 * to begin with, as long as it is complete.
 	 */
-	for (table = &(sum.pkg) + 1; *table != NULL; ++table) {
-		pkgindb_dovaquery(DELETE_REMOTE, *table, repo);
+	if ((p = getenv("PKGIN_CATALOG_DIR")) != NULL && !failed) {
+		path = xasprintf("%s/" CATALOG_FILE, p, REMOTE_DB_VERSION);
+		if (cleaned || access(path, F_OK) != 0)
+			publish_catalog(p);
+		free(path);
 	}
-	pkgindb_dovaquery(DELETE_REMOTE_PKG_REPO, repo);
+
+	/*
+	 * Everything that could be updated has been, but failures are still
+	 * fatal so that callers do not proceed with a stale repository.
+	 */
+	if (failed)
+		errx(EXIT_FAILURE, MSG_REPOS_FAILED, failed);
 }
 
 /*
- * The following section is taken verbatim from pkg_install files/admin/main.c
- * to correctly handle REQUIRED_BY entries.
+ * Write a compacted copy of the remote catalog to dir, for other hosts to
+ * install with PKGIN_CATALOG rather than import the repositories themselves.
+ * It is renamed into place, so dir may be one that is already being served.
  */
-struct reqd_by_entry {
-	char *pkgname;
-	SLIST_ENTRY(reqd_by_entry) entries;
-};
-SLIST_HEAD(reqd_by_entry_head, reqd_by_entry);
-
-struct pkg_reqd_by {
-	char *pkgname;
-	struct reqd_by_entry_head required_by[PKG_HASH_SIZE];
-	SLIST_ENTRY(pkg_reqd_by) entries;
-};
-SLIST_HEAD(pkg_reqd_by_head, pkg_reqd_by);
-
 static void
-add_required_by(const char *pattern, const char *pkgname, struct pkg_reqd_by_head *hash)
-{
-	struct pkg_reqd_by_head *phead;
-	struct pkg_reqd_by *pkg;
-	struct reqd_by_entry_head *ehead;
-	struct reqd_by_entry *entry;
-	char *best_installed;
-	int i;
-
-	best_installed = find_matching_installed_pkg(pattern, 1, 0);
-	if (best_installed == NULL) {
-		warnx("Dependency %s of %s unresolved", pattern, pkgname);
-		return;
-	}
-	phead = &hash[PKG_HASH_ENTRY(best_installed)];
-	SLIST_FOREACH(pkg, phead, entries) {
-		if (strcmp(pkg->pkgname, best_installed) == 0) {
-			ehead = &pkg->required_by[PKG_HASH_ENTRY(pkgname)];
-			SLIST_FOREACH(entry, ehead, entries) {
-				if (strcmp(entry->pkgname, pkgname) == 0)
-					break;
-			}
-			if (entry == NULL) {
-				entry = xmalloc(sizeof(*entry));
-				entry->pkgname = xstrdup(pkgname);
-				SLIST_INSERT_HEAD(ehead, entry, entries);
-			}
-			break;
-		}
-	}
-	if (pkg == NULL) {
-		pkg = xmalloc(sizeof(*pkg));
-		pkg->pkgname = xstrdup(best_installed);
-		for (i = 0; i < PKG_HASH_SIZE; i++)
-			SLIST_INIT(&pkg->required_by[i]);
-		ehead = &pkg->required_by[PKG_HASH_ENTRY(pkgname)];
-		entry = xmalloc(sizeof(*entry));
-		entry->pkgname = xstrdup(pkgname);
-		SLIST_INSERT_HEAD(ehead, entry, entries);
-		SLIST_INSERT_HEAD(phead, pkg, entries);
-	}
-	free(best_installed);
-}
-
-static int
-add_depends_of(const char *pkgname, void *cookie)
+publish_catalog(const char *dir)
 {
-	FILE *fp;
-	struct pkg_reqd_by_head *h = cookie;
-	plist_t *p;
-	package_t plist;
-	char *path;
+#if ARCHIVE_VERSION_NUMBER < 3001000
+	errx(EXIT_FAILURE, "publishing a catalog requires libarchive 3.1");
+#else
+	struct archive		*a;
+	struct archive_entry	*ae;
+	ssize_t			n;
+	char			*path, *tmp, *db, buf[65536];
+	int			fd;
+
+	path = xasprintf("%s/" CATALOG_FILE, dir, REMOTE_DB_VERSION);
+	tmp = xasprintf("%s.tmp", path);
+	db = xasprintf("%s.db", tmp);
+
+	(void) unlink(db);
+	if (pkgindb_dovaquery("VACUUM remote INTO %Q;", db) != PDB_OK)
+		errx(EXIT_FAILURE, "cannot write %s", db);
+	if ((fd = open(db, O_RDONLY)) < 0)
+		err(EXIT_FAILURE, "cannot open %s", db);
+
+	if ((a = archive_write_new()) == NULL)
+		errx(EXIT_FAILURE, "Cannot initialise archive");
+	if (archive_write_add_filter_gzip(a) != ARCHIVE_OK ||
+	    archive_write_set_format_raw(a) != ARCHIVE_OK ||
+	    archive_write_open_filename(a, tmp) != ARCHIVE_OK)
+		errx(EXIT_FAILURE, "cannot write %s: %s", tmp,
+		    archive_error_string(a));
 
-	path = pkgdb_pkg_file(pkgname, CONTENTS_FNAME);
-	if ((fp = fopen(path, "r")) == NULL)
-		errx(EXIT_FAILURE, "Cannot read %s of package %s",
-		    CONTENTS_FNAME, pkgname);
-	free(path);
-	read_plist(&plist, fp);
-	fclose(fp);
+	ae = archive_entry_new();
+	archive_entry_set_filetype(ae, AE_IFREG);
+	archive_entry_set_pathname(ae, "remote.db");
+	if (archive_write_header(a, ae) != ARCHIVE_OK)
+		errx(EXIT_FAILURE, "cannot write %s: %s", tmp,
+		    archive_error_string(a));
+	archive_entry_free(ae);
 
-	for (p = plist.head; p; p = p->next) {
-		if (p->type == PLIST_PKGDEP)
-			add_required_by(p->name, pkgname, h);
+	while ((n = read(fd, buf, sizeof(buf))) != 0) {
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			err(EXIT_FAILURE, "cannot read %s", db);
+		if (archive_write_data(a, buf, (size_t)n) != n)
+			errx(EXIT_FAILURE, "cannot write %s: %s", tmp,
+			    archive_error_string(a));
 	}
+	close(fd);
+	(void) unlink(db);
 
-	free_plist(&plist);
-
-	return 0;
-}
-
-static void
-insert_local_required_by(void)
-{
-	struct pkg_reqd_by_head pkgs[PKG_HASH_SIZE];
-	struct pkg_reqd_by *p;
-	struct reqd_by_entry *e;
-	int i, j;
-
-	for (i = 0; i < PKG_HASH_SIZE; i++)
-		SLIST_INIT(&pkgs[i]);
+	if (archive_write_close(a) != ARCHIVE_OK)
+		errx(EXIT_FAILURE, "cannot write %s: %s", tmp,
+		    archive_error_string(a));
+	archive_write_free(a);
 
-	if (iterate_pkg_db(add_depends_of, &pkgs) == -1)
-		errx(EXIT_FAILURE, "cannot iterate pkgdb");
+	if (rename(tmp, path) < 0)
+		err(EXIT_FAILURE, "cannot rename %s", tmp);
 
-	for (i = 0; i < PKG_HASH_SIZE; i++) {
-		SLIST_FOREACH(p, &pkgs[i], entries) {
-			for (j = 0; j < PKG_HASH_SIZE; j++) {
-				SLIST_FOREACH(e, &p->required_by[j], entries) {
-					pkgindb_dovaquery(INSERT_REQUIRED_BY,
-					    p->pkgname, e->pkgname);
-					free(e->pkgname);
-				}
-				while (!SLIST_EMPTY(&p->required_by[j])) {
-					e = SLIST_FIRST(&p->required_by[j]);
-					SLIST_REMOVE_HEAD(&p->required_by[j], entries);
-					free(e);
-				}
-			}
-			free(p->pkgname);
-		}
-		while (!SLIST_EMPTY(&pkgs[i])) {
-			p = SLIST_FIRST(&pkgs[i]);
-			SLIST_REMOVE_HEAD(&pkgs[i], entries);
-			free(p);
-		}
-	}
+	free(db);
+	free(tmp);
+	free(path);
+#endif
 }
 
-static void
-update_localdb(int verbose)
+/*
+ * Check that a catalog is intact and is one that this host can use, returning
+ * what is wrong with it if not.  It must have been built from exactly the
+ * repositories configured here, with the same subscriptions, as nothing else
+ * is updated from them and any difference would only have the next update
+ * import them again.
+ */
+static const char *
+check_catalog(const char *path)
 {
-	FILE *pinfo;
-	struct stat st;
-	Pkglist *lpkg;
-	int l;
+	sqlite3		*db;
+	sqlite3_stmt	*stmt = NULL;
+	Sumrepo		*repos;
+	const char	*msg = NULL, *url, *filter;
+	int		nrepos = 0, count, i;
+
+	if (sqlite3_open_v2(path, &db, SQLITE_OPEN_READONLY, NULL)
+	    != SQLITE_OK) {
+		sqlite3_close(db);
+		return "not a catalog";
+	}
 
-	/*
-	 * Start a write transaction, excluding other writers until committed.
-	 */
-	if (pkgindb_doquery("BEGIN IMMEDIATE;", NULL, NULL))
-		errx(EXIT_FAILURE, "failed to begin immediate transaction");
+	if (sqlite3_prepare_v2(db, "PRAGMA user_version;", -1, &stmt,
+	    NULL) != SQLITE_OK || sqlite3_step(stmt) != SQLITE_ROW)
+		msg = "not a catalog";
+	else if (sqlite3_column_int(stmt, 0) != REMOTE_DB_VERSION)
+		msg = "catalog version does not match";
+	sqlite3_finalize(stmt);
+	stmt = NULL;
+
+	if (msg == NULL && (sqlite3_prepare_v2(db, "PRAGMA quick_check;", -1,
+	    &stmt, NULL) != SQLITE_OK || sqlite3_step(stmt) != SQLITE_ROW ||
+	    strcmp((const char *)sqlite3_column_text(stmt, 0), "ok") != 0))
+		msg = "catalog is damaged";
+	sqlite3_finalize(stmt);
+	stmt = NULL;
+
+	for (nrepos = 0; pkg_repos[nrepos] != NULL; nrepos++)
+		;
+	repos = xcalloc((size_t)nrepos, sizeof(Sumrepo));
+	for (i = 0; i < nrepos; i++)
+		repos[i].url = pkg_repos[i];
+	load_subscriptions(repos, nrepos);
+
+	if (msg == NULL && sqlite3_prepare_v2(db, SELECT_REPO_FILTERS, -1,
+	    &stmt, NULL) != SQLITE_OK)
+		msg = "not a catalog";
+	for (count = 0; msg == NULL && sqlite3_step(stmt) == SQLITE_ROW;
+	    count++) {
+		url = (const char *)sqlite3_column_text(stmt, 0);
+		filter = (const char *)sqlite3_column_text(stmt, 1);
+		for (i = 0; i < nrepos; i++)
+			if (url != NULL && strcmp(pkg_repos[i], url) == 0)
+				break;
+		if (i == nrepos)
+			msg = "catalog is for other repositories";
+		else if (repos[i].filter == NULL ? filter != NULL :
+		    filter == NULL || strcmp(repos[i].filter, filter) != 0)
+			msg = "catalog is for other subscriptions";
+	}
+	sqlite3_finalize(stmt);
 
-	/*
-	 * Only replace the database if forced or if the pkgdb changed.
-	 */
-	if (!pkg_db_mtime(&st) && !force_fetch)
-		goto out;
+	if (msg == NULL && count != nrepos)
+		msg = "catalog is for other repositories";
 
-	/*
-	 * Delete and recreate the LOCAL_PKG table, as it's simpler and faster
-	 * than updating.
-	 */
-	pkgindb_doquery(DELETE_LOCAL, NULL, NULL);
+	for (i = 0; i < nrepos; i++)
+		free_subscription(&repos[i]);
+	free(repos);
 
-	if (verbose)
-		printf(MSG_READING_LOCAL_SUMMARY);
+	sqlite3_close(db);
 
-	if ((pinfo = popen(PKG_INSTALL_DIR "/pkg_info -Xa", "r")) == NULL)
-		errx(EXIT_FAILURE, "Couldn't run pkg_info");
+	return msg;
+}
 
-	if (verbose)
-		printf(MSG_PROCESSING_LOCAL_SUMMARY);
+/*
+ * libarchive does not verify the CRC-32 at the end of a gzip file, so it is
+ * calculated here as the catalog is decompressed, by zlib if available.
+ */
+static uint32_t
+catalog_crc32(uint32_t crc, const unsigned char *buf, size_t len)
+{
+#ifdef HAVE_ZLIB
+	return (uint32_t)crc32(crc, buf, (uInt)len);
+#else
+	static uint32_t	table[256];
+	uint32_t	c;
+	int		i, j;
+
+	if (table[1] == 0) {
+		for (i = 0; i < 256; i++) {
+			for (c = (uint32_t)i, j = 0; j < 8; j++)
+				c = (c & 1) ? 0xedb88320U ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+	}
 
-	insert_local_summary(pinfo);
-	insert_local_required_by();
-	pkg_db_update_mtime(&st);
-	pclose(pinfo);
+	crc = ~crc;
+	while (len-- > 0)
+		crc = table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
 
-	/*
-	 * Reread the local package list.  This updates l_plisthead.
-	 */
-	free_local_pkglist();
-	init_local_pkglist();
+	return ~crc;
+#endif
+}
 
-	/*
-	 * Insert PKG_KEEP database entries based on pkgdb data.
-	 */
-	for (l = 0; l < LOCAL_PKG_HASH_SIZE; l++) {
-	SLIST_FOREACH(lpkg, &l_plisthead[l], next) {
-		if (!is_automatic_installed(lpkg->full)) {
-			pkg_keep(KEEP, lpkg->full);
-		}
-	}
+/*
+ * Return the CRC-32 and size recorded in the trailer of a gzip file.
+ */
+static int
+catalog_trailer(const char *path, uint32_t *crc, uint32_t *isize)
+{
+	unsigned char	buf[8];
+	int		fd, rv = -1;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+	if (read(fd, buf, 2) == 2 && buf[0] == 0x1f && buf[1] == 0x8b &&
+	    lseek(fd, -8, SEEK_END) >= 0 && read(fd, buf, 8) == 8) {
+		*crc = (uint32_t)buf[0] | (uint32_t)buf[1] << 8 |
+		    (uint32_t)buf[2] << 16 | (uint32_t)buf[3] << 24;
+		*isize = (uint32_t)buf[4] | (uint32_t)buf[5] << 8 |
+		    (uint32_t)buf[6] << 16 | (uint32_t)buf[7] << 24;
+		rv = 0;
 	}
-out:
-	if (pkgindb_doquery("COMMIT;", NULL, NULL))
-		errx(EXIT_FAILURE, "failed to commit transaction");
+	close(fd);
+
+	return rv;
 }
 
 /*
- * Check to see if database repositories are still configured.  If not, delete
- * and force a refresh.
+ * Decompress the catalog at src to remote.db.new and, once checked, replace
+ * remote.db with it.
  */
-static int
-pdb_delete_remote(void *param, int argc, char **argv, char **colname)
+static void
+install_catalog(const char *src, const char *url)
 {
-	int i;
+	struct archive		*a;
+	struct archive_entry	*ae;
+	const char		*msg;
+	ssize_t			n, wrote;
+	size_t			off;
+	uint32_t		crc = 0, sumcrc, sumsize, size = 0;
+	char			buf[65536];
+	int			fd;
 
-	if (argv == NULL)
-		return PDB_ERR;
+	if (catalog_trailer(src, &sumcrc, &sumsize) != 0)
+		errx(EXIT_FAILURE, "%s: %s", url, "not a catalog");
 
-	for (i = 0; pkg_repos[i] != NULL; i++) {
-		if (strcmp(pkg_repos[i], argv[0]) == 0)
-			return PDB_OK;
+	pkgindb_remote_lock();
+
+	if ((fd = open(pkgin_remotedb_new, O_WRONLY | O_CREAT | O_TRUNC,
+	    0644)) < 0)
+		err(EXIT_FAILURE, "cannot create %s", pkgin_remotedb_new);
+
+	if ((a = archive_read_new()) == NULL)
+		errx(EXIT_FAILURE, "Cannot initialise archive");
+#if ARCHIVE_VERSION_NUMBER < 3000000
+	archive_read_support_compression_all(a);
+#else
+	archive_read_support_filter_all(a);
+#endif
+	archive_read_support_format_raw(a);
+	if (archive_read_open_filename(a, src, sizeof(buf)) != ARCHIVE_OK ||
+	    archive_read_next_header(a, &ae) != ARCHIVE_OK)
+		errx(EXIT_FAILURE, "%s: %s", url, archive_error_string(a));
+
+	while ((n = archive_read_data(a, buf, sizeof(buf))) > 0) {
+		crc = catalog_crc32(crc, (unsigned char *)buf, (size_t)n);
+		size += (uint32_t)n;
+		for (off = 0; off < (size_t)n; off += (size_t)wrote) {
+			if ((wrote = write(fd, buf + off,
+			    (size_t)n - off)) < 0 && errno == EINTR)
+				wrote = 0;
+			else if (wrote < 0)
+				err(EXIT_FAILURE, "cannot write %s",
+				    pkgin_remotedb_new);
+		}
 	}
+	if (n < 0)
+		errx(EXIT_FAILURE, "%s: %s", url, archive_error_string(a));
+	archive_read_free(a);
 
-	printf(MSG_CLEANING_DB_FROM_REPO, argv[0]);
-	delete_remote_tbl(sumsw[REMOTE_SUMMARY], argv[0]);
-	pkgindb_dovaquery(DELETE_REPO_URL, argv[0]);
+	if (close(fd) < 0)
+		err(EXIT_FAILURE, "cannot write %s", pkgin_remotedb_new);
 
-	force_fetch = 1;
+	if (crc != sumcrc || size != sumsize)
+		errx(EXIT_FAILURE, "%s: %s", url, "checksum mismatch");
+	if ((msg = check_catalog(pkgin_remotedb_new)) != NULL)
+		errx(EXIT_FAILURE, "%s: %s", url, msg);
 
-	return PDB_OK;
+	pkgindb_remote_commit();
 }
 
+/*
+ * Install the catalog published at PKGIN_CATALOG instead of updating from the
+ * repositories.  The copy that remote.db was last installed from is kept in
+ * pkgin_sumdir and provides the validators, so like a pkg_summary it is only
+ * downloaded again once it has changed.
+ */
 static void
-update_remotedb(int verbose)
+update_catalog(const char *catalog, int verbose)
 {
-	struct archive	*a;
-	time_t		repo_mtime;
-	char		**prepos;
-	uint8_t		cleaned = 0;
-
-	/* loop through PKG_REPOS */
-	for (prepos = pkg_repos; *prepos != NULL; prepos++) {
+	Sumfile		*sum;
+	struct stat	st;
+	struct timeval	tv[2];
+	time_t		mtime = 0;
+	off_t		size = -1, fetched = 0;
+	ssize_t		n, wrote;
+	size_t		off;
+	char		*url, *path, *tmp, npkgs[32], buf[65536], errbuf[256];
+	int		fd;
+
+	url = xasprintf("%s/" CATALOG_FILE, catalog, REMOTE_DB_VERSION);
+	path = xasprintf("%s/" CATALOG_FILE, pkgin_sumdir, REMOTE_DB_VERSION);
+	tmp = xasprintf("%s.tmp", path);
+
+	if (!force_fetch && stat(path, &st) == 0) {
+		mtime = st.st_mtime;
+		size = st.st_size;
+	}
 
+	if ((sum = sum_open(url, &mtime, size, errbuf, sizeof(errbuf)))
+	    == NULL) {
+		if (mtime != -1)
+			errx(EXIT_FAILURE, MSG_COULDNT_FETCH, url, errbuf);
+		/*
+		 * Unchanged, but remote.db may have been recreated since.
+		 */
+		npkgs[0] = '\0';
+		pkgindb_doquery(COUNT_REMOTE_PKG, pdb_get_value, npkgs);
+		if (strcmp(npkgs, "0") == 0)
+			install_catalog(path, url);
 		if (verbose)
-			printf(MSG_PROCESSING_REMOTE_SUMMARY, *prepos);
+			printf("%s: up-to-date\n", url);
+		goto out;
+	}
 
-		/* load remote pkg_summary */
-		if ((a = fetch_summary(*prepos, &repo_mtime)) == NULL) {
-			if (verbose)
-				printf(MSG_DB_IS_UP_TO_DATE, *prepos);
-			continue;
-		}
+	if (access(pkgin_sumdir, F_OK) != 0)
+		(void) mkdir(pkgin_sumdir, 0755);
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+		err(EXIT_FAILURE, "cannot create %s", tmp);
 
-		/* Delete any unused repositories. */
-		if (!cleaned) {
-			pkgindb_doquery(SELECT_REPO_URLS, pdb_delete_remote,
-			    NULL);
-			cleaned = 1;
+	while ((n = fetchIO_read(sum->fd, buf, sizeof(buf))) != 0) {
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			errx(EXIT_FAILURE, MSG_COULDNT_FETCH, url,
+			    fetchLastErrString);
+		for (off = 0; off < (size_t)n; off += (size_t)wrote) {
+			if ((wrote = write(fd, buf + off,
+			    (size_t)n - off)) < 0 && errno == EINTR)
+				wrote = 0;
+			else if (wrote < 0)
+				err(EXIT_FAILURE, "cannot write %s", tmp);
 		}
+		fetched += n;
+	}
+	if (close(fd) < 0)
+		err(EXIT_FAILURE, "cannot write %s", tmp);
+	if (sum->size > 0 && fetched != sum->size)
+		errx(EXIT_FAILURE, MSG_COULDNT_FETCH, url, "truncated");
+	sum_close(sum);
+
+	if (mtime > 0) {
+		memset(tv, 0, sizeof(tv));
+		tv[0].tv_sec = tv[1].tv_sec = mtime;
+		(void) utimes(tmp, tv);
+	}
 
-		/* delete remote* associated to this repository */
-		delete_remote_tbl(sumsw[REMOTE_SUMMARY], *prepos);
-
-		/* update remote* table for this repository */
-		insert_remote_summary(a, *prepos);
+	install_catalog(tmp, url);
+	if (rename(tmp, path) < 0)
+		(void) unlink(tmp);
 
-		/* mark repository as being updated with new mtime */
-		pkgindb_dovaquery(UPDATE_REPO_MTIME, (long long)repo_mtime, *prepos);
+	if (verbose) {
+		npkgs[0] = '\0';
+		pkgindb_doquery(COUNT_REMOTE_PKG, pdb_get_value, npkgs);
+		printf("%s: done: %s packages\n", url, npkgs);
 	}
-
-	/* remove empty rows (duplicates) */
-	pkgindb_doquery(DELETE_EMPTY_ROWS, NULL, NULL);
+out:
+	free(tmp);
+	free(path);
+	free(url);
 }
 
 int
 update_db(int which, int verbose)
 {
+	char	*p;
+
 	if (!have_privs(PRIVS_PKGINDB))
 		return EXIT_FAILURE;
 
 	/* always check for LOCAL_SUMMARY updates */
 	update_localdb(verbose);
 
-	if (which == REMOTE_SUMMARY)
-		update_remotedb(verbose);
+	if (which == REMOTE_SUMMARY) {
+		if ((p = getenv("PKGIN_CATALOG")) != NULL)
+			update_catalog(p, verbose);
+		else
+			update_remotedb(verbose);
+	}
 
 	/* columns name not needed anymore */
 	freecols();
@@ -959,17 +3661,45 @@ split_repos(void)
 
 	/* NULL last element */
 	pkg_repos[repocount - 1] = NULL;
+}
 
-	repo_record(pkg_repos);
+static int
+pdb_unconfigured_repo(void *param, int argc, char **argv, char **colname)
+{
+	int i;
+
+	if (argv == NULL)
+		return PDB_ERR;
+
+	for (i = 0; pkg_repos[i] != NULL; i++) {
+		if (strcmp(pkg_repos[i], argv[0]) == 0)
+			return PDB_OK;
+	}
+
+	/*
+	 * Deleting it from a shared catalog would only have the roots that
+	 * still use it put it back again, so they must agree first.
+	 */
+	if (remote_shared() && !*(int *)param)
+		errx(EXIT_FAILURE, MSG_REPO_NOT_SHARED, argv[0],
+		    pkgin_remotedb);
+
+	force_fetch = 1;
+
+	return PDB_OK;
 }
 
 /*
- * Delete any repositories from the database if they are no longer configured.
+ * Check for repositories in the remote catalog that are no longer configured,
+ * which the next update then deletes.  That is left to the update so that
+ * the catalog is only ever replaced and never modified while it may be read.
+ * A shared catalog is only changed like this when forced, once every root
+ * has stopped using them.
  */
 int
 chk_repo_list(int force)
 {
-	pkgindb_doquery(SELECT_REPO_URLS, pdb_delete_remote, NULL);
+	pkgindb_doquery(SELECT_REPO_URLS, pdb_unconfigured_repo, &force);
 
 	if (force)
 		force_fetch = 1;